@@ -13,6 +13,8 @@ entity keyboard is
 		avs_address   : in  std_logic_vector(1 downto 0);
 		avs_readdata  : out std_logic_vector(31 downto 0);
 		avs_writedata : in  std_logic_vector(31 downto 0);
+		-- Interrupt, level sensitive
+		irq           : out std_logic;
 		-- Export
 		rows          : out std_logic_vector(2 downto 0);
 		columns       : in  std_logic_vector(6 downto 0)
@@ -22,40 +24,143 @@ end entity;
 architecture keyboard_arch of keyboard is
 	
 	constant SYS_CLK_PERIOD : time := 20 ns;
+	constant CLKS_PER_US    : integer := 1 us / SYS_CLK_PERIOD;
 	
-	signal count   : unsigned(19 downto 0);
-	signal div_clk : std_logic;
+	-- Time per row step in us; the reset value keeps the original 2^20 cycles
+	constant SCAN_PERIOD_DEFAULT : unsigned(15 downto 0) := to_unsigned(20972, 16);
+	constant SCAN_PERIOD_MIN     : unsigned(15 downto 0) := to_unsigned(100, 16);
+	
+	-- Lockout of the column debouncers, reported in ctrl(15 downto 8)
+	constant DEBOUNCE_MS   : integer := 5;
+	constant DEBOUNCE_TIME : time := DEBOUNCE_MS * 1 ms;
+	
+	signal prescale : unsigned(5 downto 0);
+	signal count    : unsigned(15 downto 0);
+	signal div_clk  : std_logic;
+	
+	-- Columns after the synchronizers, after the debouncers, and as scanned
+	signal columns_sync : std_logic_vector(6 downto 0);
+	signal columns_deb  : std_logic_vector(6 downto 0);
+	signal columns_in   : std_logic_vector(6 downto 0);
 	
 	signal row_sig   : std_logic_vector(2 downto 0);
 	signal kb_buffer : std_logic_vector(31 downto 0);
 	
+	-- kb_buffer is written on div_clk; these bring it into the clk domain
+	signal kb_sample : std_logic_vector(31 downto 0);
+	signal kb_stable : std_logic_vector(31 downto 0);
+	signal kb_last   : std_logic_vector(31 downto 0);
+	
+	-- Bit 0: the row sweep latched a new code (press or release)
+	-- Bit 1: a code was dropped because the event FIFO was full
+	signal irq_status : std_logic_vector(31 downto 0);
+	
+	-- Bits 1:0 = irq enables, bit 7 = debounce enable,
+	-- bits 31:16 = scan period in us
+	signal ctrl        : std_logic_vector(31 downto 0);
+	signal scan_period : unsigned(15 downto 0);
+	signal debounce_en : std_logic;
+	
+	-- Event FIFO of latched codes, popped by reads of fifo_data
+	constant FIFO_DEPTH : integer := 16;
+	type fifo_array is array (0 to FIFO_DEPTH - 1) of std_logic_vector(8 downto 0);
+	signal fifo       : fifo_array;
+	signal fifo_wr    : unsigned(3 downto 0);
+	signal fifo_rd    : unsigned(3 downto 0);
+	signal fifo_level : unsigned(4 downto 0);
+	signal fifo_word  : std_logic_vector(31 downto 0);
+	signal fifo_pop   : std_logic;
+	
+	-- Every read takes two cycles (readWaitTime 1): '0' on the first cycle of
+	-- a transfer, '1' on its last. Back-to-back reads keep avs_read high, so
+	-- the phase comes from counting cycles, not from edges of avs_read.
+	signal read_phase : std_logic;
+	
+	component synchronizer is
+		port (
+			clk   : in  std_ulogic;
+			async : in  std_ulogic;
+			sync  : out std_ulogic
+		);
+	end component;
+	
+	component debouncer is
+		generic (
+			clk_period    : time := 20 ns;
+			debounce_time : time
+		);
+		port (
+			clk       : in  std_ulogic;
+			rst       : in  std_ulogic;
+			input     : in  std_ulogic;
+			debounced : out std_ulogic
+		);
+	end component;
+	
 begin
 	
-	-- Clock divider
+	scan_period <= unsigned(ctrl(31 downto 16));
+	debounce_en <= ctrl(7);
+	
+	-- Clock divider: a 1 us prescaler, then one div_clk period per scan_period
 	CLOCK_DIV : process (clk, rst)
 	begin
 		if rst = '1' then
-			count <= x"00000";
-			div_clk <= '0';
+			prescale <= (others => '0');
+			count    <= (others => '0');
+			div_clk  <= '0';
 			
-		elsif rising_edge(clk) then	-- Period of div_clk = 2e-8 * 2^20 = 0.021 sec (48 Hz)
-		
-			if count >= x"FFFFF" then
-				count <= x"00000";
-				div_clk <= '0';
-			elsif count >= x"7FFFF" then
-				count <= count + 1;
-				div_clk <= '1';
+		elsif rising_edge(clk) then
+			
+			if prescale >= CLKS_PER_US - 1 then
+				prescale <= (others => '0');
+				if count >= scan_period - 1 then
+					count   <= (others => '0');
+					div_clk <= '0';
+				elsif count >= shift_right(scan_period, 1) - 1 then
+					count   <= count + 1;
+					div_clk <= '1';
+				else
+					count   <= count + 1;
+					div_clk <= div_clk;
+				end if;
 			else
-				count <= count + 1;
-				div_clk <= div_clk;
+				prescale <= prescale + 1;
 			end if;
-		
+			
 		end if;
 	end process;
 	
+	-- Every column goes through a synchronizer and a debouncer. The debouncer
+	-- passes the first edge straight through and then ignores the input for
+	-- DEBOUNCE_TIME, so it adds no latency but hides contact bounce. That
+	-- lockout has to end before the next row step, so the scan period must be
+	-- longer than DEBOUNCE_TIME while debouncing is enabled.
+	COLUMN_CONDITIONING : for i in 0 to 6 generate
+		COLUMN_SYNC : synchronizer
+			port map (
+				clk   => clk,
+				async => columns(i),
+				sync  => columns_sync(i)
+			);
+		
+		COLUMN_DEBOUNCE : debouncer
+			generic map (
+				clk_period    => SYS_CLK_PERIOD,
+				debounce_time => DEBOUNCE_TIME
+			)
+			port map (
+				clk       => clk,
+				rst       => rst,
+				input     => columns_sync(i),
+				debounced => columns_deb(i)
+			);
+	end generate;
+	
+	columns_in <= columns_deb when debounce_en = '1' else columns_sync;
+	
 	-- Row sweep state machine
-	ROW_SWEEP : process (div_clk, rst, row_sig, columns)
+	ROW_SWEEP : process (div_clk, rst, row_sig, columns_in)
 	begin
 		if rst = '1' then
 			kb_buffer <= x"00000000";
@@ -64,7 +169,7 @@ begin
 		elsif rising_edge(div_clk) then
 			case row_sig is
 				when "001" =>
-					case columns is
+					case columns_in is
 						when "0100000" => kb_buffer <= x"00000147"; row_sig <= "001";
 						when "0010000" => kb_buffer <= x"00000148"; row_sig <= "001";
 						when "0001000" => kb_buffer <= x"00000149"; row_sig <= "001";
@@ -77,7 +182,7 @@ begin
 					end case;
 				
 				when "010" =>
-					case columns is
+					case columns_in is
 						when "0100000" => kb_buffer <= x"00000144"; row_sig <= "010";
 						when "0010000" => kb_buffer <= x"00000145"; row_sig <= "010";
 						when "0001000" => kb_buffer <= x"00000146"; row_sig <= "010";
@@ -90,7 +195,7 @@ begin
 					end case;
 				
 				when "100" =>
-					case columns is
+					case columns_in is
 						when "1000000" => kb_buffer <= x"00000140"; row_sig <= "100";
 						when "0100000" => kb_buffer <= x"00000141"; row_sig <= "100";
 						when "0010000" => kb_buffer <= x"00000142"; row_sig <= "100";
@@ -112,12 +217,90 @@ begin
 	
 	rows <= row_sig;
 	
+	-- Whenever kb_buffer settles on a new value, push it into the event FIFO
+	-- and raise irq_status(0). The value is sampled twice and only taken once
+	-- both samples agree, so a sample taken while the div_clk update is in
+	-- flight never counts as a code. A code that finds the FIFO full is
+	-- dropped and raises irq_status(1). Writing 1 to a status bit clears it.
+	KEY_EVENTS : process (clk, rst)
+		variable push : boolean;
+		variable pop  : boolean;
+	begin
+		if rst = '1' then
+			kb_sample  <= x"00000000";
+			kb_stable  <= x"00000000";
+			kb_last    <= x"00000000";
+			irq_status <= x"00000000";
+			fifo_wr    <= "0000";
+			fifo_rd    <= "0000";
+			fifo_level <= "00000";
+			read_phase <= '0';
+			
+		elsif rising_edge(clk) then
+			kb_sample  <= kb_buffer;
+			kb_stable  <= kb_sample;
+			if avs_read = '1' then
+				read_phase <= not read_phase;
+			else
+				read_phase <= '0';
+			end if;
+			
+			if avs_write = '1' and avs_address = "01" then
+				irq_status <= irq_status and not avs_writedata;
+			end if;
+			
+			push := kb_stable = kb_sample and kb_stable /= kb_last;
+			pop  := fifo_pop = '1' and fifo_level /= 0;
+			
+			if push then
+				kb_last       <= kb_stable;
+				irq_status(0) <= '1';
+				if fifo_level = FIFO_DEPTH and not pop then
+					push          := false;
+					irq_status(1) <= '1';
+				end if;
+			end if;
+			
+			if push then
+				fifo(to_integer(fifo_wr)) <= kb_stable(8 downto 0);
+				fifo_wr <= fifo_wr + 1;
+			end if;
+			if pop then
+				fifo_rd <= fifo_rd + 1;
+			end if;
+			
+			if push and not pop then
+				fifo_level <= fifo_level + 1;
+			elsif pop and not push then
+				fifo_level <= fifo_level - 1;
+			end if;
+		end if;
+	end process;
+	
+	-- A read of fifo_data pops on its last cycle, once the head is latched
+	fifo_pop <= '1' when avs_read = '1' and read_phase = '1' and avs_address = "11" else '0';
+	
+	-- fifo_data: bit 31 = valid, bit 30 = FIFO present (always 1),
+	-- bits 20:16 = entries including this one, bits 8:0 = kb_buffer code
+	fifo_word <= "11" & "000000000" & std_logic_vector(fifo_level) & "0000000" & fifo(to_integer(fifo_rd))
+		when fifo_level /= 0 else
+		"01" & "000000000" & "00000" & "0000000" & "000000000";
+	
+	irq <= '1' when (irq_status(1 downto 0) and ctrl(1 downto 0)) /= "00" else '0';
+	
 	-- Read registers
 	AVALON_REGISTER_READ : process(clk, avs_read) is
 	begin
 		if rising_edge(clk) and avs_read = '1' then
 			case avs_address is
-				when "00"   => avs_readdata <= kb_buffer;
+				when "00"   => avs_readdata <= kb_last;
+				when "01"   => avs_readdata <= irq_status;
+				when "10"   => avs_readdata <= ctrl(31 downto 16) & std_logic_vector(to_unsigned(DEBOUNCE_MS, 8)) & ctrl(7 downto 0);
+				when "11"   =>
+					-- Latch the head on the first cycle, before the pop advances it
+					if read_phase = '0' then
+						avs_readdata <= fifo_word;
+					end if;
 				when others => avs_readdata <= (others => '0');
 			end case;
 		end if;
@@ -127,10 +310,19 @@ begin
 	AVALON_REGISTER_WRITE : process (clk, rst, avs_write) is
 	begin
 		if rst = '1' then
+			ctrl <= std_logic_vector(SCAN_PERIOD_DEFAULT) & x"0080";
 			
 		elsif rising_edge(clk) and avs_write = '1' then
 			case avs_address is
-				when others => null; -- Ignore all writes
+				when "10"   =>
+					-- Clamp the scan period so the divider always runs
+					if unsigned(avs_writedata(31 downto 16)) < SCAN_PERIOD_MIN then
+						ctrl(31 downto 16) <= std_logic_vector(SCAN_PERIOD_MIN);
+					else
+						ctrl(31 downto 16) <= avs_writedata(31 downto 16);
+					end if;
+					ctrl(15 downto 0) <= x"00" & avs_writedata(7) & "00000" & avs_writedata(1 downto 0);
+				when others => null; -- kb_buffer is read-only; irq_status is cleared in KEY_EVENTS
 			end case;
 		end if;
 	end process;
@@ -21,11 +21,97 @@ end entity;
 
 architecture lcd_arch of lcd is
 	
+	constant SYS_CLK_PERIOD : time := 20 ns;
+	
+	-- HD44780 execution times: clear display and return home take 1.52 ms,
+	-- other instructions 37 us, and data writes 37 us plus 4 us to update
+	-- the address counter
+	constant SLOW_CYCLES  : integer := 1520 us / SYS_CLK_PERIOD;
+	constant INSTR_CYCLES : integer := 37 us / SYS_CLK_PERIOD;
+	constant DATA_CYCLES  : integer := 41 us / SYS_CLK_PERIOD;
+	
 	signal ctl_reg  : std_logic_vector(31 downto 0);
 	signal data_reg : std_logic_vector(31 downto 0);
 	
+	-- The data bus is output-only on this board, so the LCD's own busy flag
+	-- can't be read back. Instead, busy_count runs for the execution time of
+	-- the instruction latched by the last falling edge of E.
+	signal enable_d   : std_logic;
+	signal busy_count : unsigned(16 downto 0);
+	signal status_reg : std_logic_vector(31 downto 0);
+	
+	-- Command FIFO and timing engine, fed by writes to the fifo register.
+	-- While it is busy, it drives the LCD instead of ctl_reg and data_reg.
+	signal fifo_wr     : std_logic;
+	signal fifo_free   : std_logic_vector(8 downto 0);
+	signal engine_busy : std_logic;
+	signal engine_ctl  : std_logic_vector(2 downto 0);
+	signal engine_data : std_logic_vector(7 downto 0);
+	signal lcd_ctl     : std_logic_vector(2 downto 0);
+	signal lcd_data    : std_logic_vector(7 downto 0);
+	
+	-- lcd_fsm ---------------------------------------------------
+	component lcd_fsm is
+		port
+		(
+			clk       : in  std_logic;
+			rst       : in  std_logic;
+			wr_en     : in  std_logic;
+			wr_data   : in  std_logic_vector(8 downto 0);
+			fifo_free : out std_logic_vector(8 downto 0);
+			busy      : out std_logic;
+			ctl       : out std_logic_vector(2 downto 0);
+			data      : out std_logic_vector(7 downto 0)
+		);
+	end component;
+	--------------------------------------------------- lcd_fsm --
+	
 begin
 	
+	-- Command FIFO and timing engine
+	fifo_wr <= '1' when avs_write = '1' and avs_address = "11" else '0';
+	
+	ENGINE : lcd_fsm
+		port map
+		(
+			clk       => clk,
+			rst       => rst,
+			wr_en     => fifo_wr,
+			wr_data   => avs_writedata(8 downto 0),
+			fifo_free => fifo_free,
+			busy      => engine_busy,
+			ctl       => engine_ctl,
+			data      => engine_data
+		);
+	
+	-- Busy timer, started when E falls
+	BUSY_TIMER : process (clk, rst)
+	begin
+		if rst = '1' then
+			enable_d   <= '0';
+			busy_count <= (others => '0');
+			
+		elsif rising_edge(clk) then
+			enable_d <= ctl_reg(0);
+			
+			if enable_d = '1' and ctl_reg(0) = '0' then
+				if ctl_reg(2) = '1' then
+					busy_count <= to_unsigned(DATA_CYCLES, busy_count'length);
+				elsif data_reg(7 downto 2) = "000000" and data_reg(1 downto 0) /= "00" then
+					busy_count <= to_unsigned(SLOW_CYCLES, busy_count'length);
+				else
+					busy_count <= to_unsigned(INSTR_CYCLES, busy_count'length);
+				end if;
+			elsif busy_count /= 0 then
+				busy_count <= busy_count - 1;
+			end if;
+		end if;
+	end process;
+	
+	-- status: bit 31 = status register present (always 1), bit 30 = command
+	-- FIFO present (always 1), bit 0 = busy
+	status_reg <= x"C0000001" when busy_count /= 0 or ctl_reg(0) = '1' or engine_busy = '1' else x"C0000000";
+	
 	-- Read registers
 	AVALON_REGISTER_READ : process(clk, avs_read) is
 	begin
@@ -34,6 +120,8 @@ begin
 				
 				when "00"   => avs_readdata <= ctl_reg;
 				when "01"   => avs_readdata <= data_reg;
+				when "10"   => avs_readdata <= status_reg;
+				when "11"   => avs_readdata <= x"0000" & "0000000" & fifo_free;
 				when others => avs_readdata <= (others => '0');
 				
 			end case;
@@ -52,14 +140,17 @@ begin
 				
 				when "00"   => ctl_reg  <= avs_writedata;
 				when "01"   => data_reg <= avs_writedata;
-				when others => null; -- Ignore writes to unused registers
+				when others => null; -- status is read-only; fifo writes go to ENGINE
 				
 			end case;
 		end if;
 	end process;
 	
-	ctl_n  <= not ctl_reg(2 downto 0);
-	data_n <= not data_reg(0) & not data_reg(1) & not data_reg(2) & not data_reg(3)
-	        & not data_reg(4) & not data_reg(5) & not data_reg(6) & not data_reg(7);
+	lcd_ctl  <= engine_ctl  when engine_busy = '1' else ctl_reg(2 downto 0);
+	lcd_data <= engine_data when engine_busy = '1' else data_reg(7 downto 0);
+	
+	ctl_n  <= not lcd_ctl;
+	data_n <= not lcd_data(0) & not lcd_data(1) & not lcd_data(2) & not lcd_data(3)
+	        & not lcd_data(4) & not lcd_data(5) & not lcd_data(6) & not lcd_data(7);
 	
 end architecture;
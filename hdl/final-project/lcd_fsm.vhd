@@ -2,184 +2,167 @@ library ieee;
 use ieee.std_logic_1164.all;
 use ieee.numeric_std.all;
 
-entity lcd is	
+-- HD44780 timing engine. Commands queued in the FIFO are sent one at a time:
+-- the engine drives RS and the data bus, pulses E, and then waits out the
+-- instruction's execution time before it pops the next command.
+entity lcd_fsm is
 	port
 	(
 		clk  : in  std_logic;
 		rst  : in  std_logic;
-		-- Avalon Memory-Mapped Ports
-	--	avs_read      : in  std_logic;
-	--	avs_write     : in  std_logic;
-	--	avs_address   : in  std_logic_vector(1 downto 0);
-	--	avs_readdata  : out std_logic_vector(31 downto 0);
-	--	avs_writedata : in  std_logic_vector(31 downto 0);
-		-- Export
-		lcd_ctl_n  : out std_logic_vector(2 downto 0);
-		lcd_data_n : out std_logic_vector(7 downto 0)
+		-- Command FIFO: bit 8 = RS (1 for a character), bits 7:0 = byte
+		wr_en     : in  std_logic;
+		wr_data   : in  std_logic_vector(8 downto 0);
+		fifo_free : out std_logic_vector(8 downto 0);
+		-- High while the FIFO holds commands or one is being executed
+		busy : out std_logic;
+		-- LCD strobes, active high: bit 0 = E, bit 1 = RW, bit 2 = RS
+		ctl  : out std_logic_vector(2 downto 0);
+		data : out std_logic_vector(7 downto 0)
 	);
 end entity;
 
-architecture lcd_arch of lcd is
+architecture lcd_fsm_arch of lcd_fsm is
 	
-	constant sys_clk_period      : time := 20 ns;
-	constant lcd_clk_period      : time := 10 ms;
-	constant cyc_per_half_period : natural := (lcd_clk_period / sys_clk_period) / 2;
+	constant SYS_CLK_PERIOD : time := 20 ns;
 	
-	signal counter : natural := 0;
-	signal lcd_clk : std_logic;
+	-- Bus timing: address setup 40 ns, E high 230 ns, E cycle 500 ns
+	constant SETUP_CYCLES : integer := 60 ns / SYS_CLK_PERIOD;
+	constant PULSE_CYCLES : integer := 300 ns / SYS_CLK_PERIOD;
+	constant HOLD_CYCLES  : integer := 200 ns / SYS_CLK_PERIOD;
 	
-	type state is
-	(
-		rst_0, rst_1,  rst_2,  rst_3,  rst_4,  rst_5,  rst_6,  rst_7,
-		rst_8, rst_9, rst_10, rst_11, rst_12, rst_13, rst_14,
-		write_0, write_1, write_2,
-		idle
-	);
-	signal curr_state : state;
+	-- Execution times: clear display and return home take 1.52 ms, other
+	-- instructions 37 us, and data writes 37 us plus 4 us for the address
+	-- counter
+	constant SLOW_CYCLES  : integer := 1520 us / SYS_CLK_PERIOD;
+	constant INSTR_CYCLES : integer := 37 us / SYS_CLK_PERIOD;
+	constant DATA_CYCLES  : integer := 41 us / SYS_CLK_PERIOD;
 	
-	signal ctl  : std_logic_vector(2 downto 0);
-	signal data : std_logic_vector(7 downto 0);
+	constant FIFO_DEPTH : integer := 256;
+	type fifo_array is array (0 to FIFO_DEPTH - 1) of std_logic_vector(8 downto 0);
+	signal fifo       : fifo_array;
+	signal fifo_wr    : unsigned(7 downto 0);
+	signal fifo_rd    : unsigned(7 downto 0);
+	signal fifo_level : unsigned(8 downto 0);
+	signal fifo_push  : std_logic;
+	signal fifo_q     : std_logic_vector(8 downto 0);
 	
---	signal reg : std_logic_vector(31 downto 0);
+	type state is (idle, fetch, setup, pulse, hold, exec);
+	signal curr_state : state;
+	
+	signal cmd   : std_logic_vector(8 downto 0);
+	signal timer : unsigned(16 downto 0);
 	
 begin
 	
-	-- Clock divider
-	CLOCK_DIV : process (clk, rst)
+	-- Commands that find the FIFO full are dropped
+	fifo_push <= '1' when wr_en = '1' and fifo_level /= FIFO_DEPTH else '0';
+	
+	-- FIFO storage, kept free of the reset so it maps onto block RAM. The
+	-- read is registered: fifo_q holds the entry at fifo_rd one cycle later.
+	FIFO_RAM : process (clk)
 	begin
-		if rst = '1' then
-			counter <= 0;
-			lcd_clk <= '0';
-			
-		elsif rising_edge(clk) then
-			if counter >= cyc_per_half_period then
-				counter <= 0;
-				lcd_clk <= not lcd_clk;
-			
-			else
-				counter <= counter + 1;
-				lcd_clk <= lcd_clk;
-				
+		if rising_edge(clk) then
+			if fifo_push = '1' then
+				fifo(to_integer(fifo_wr)) <= wr_data;
 			end if;
+			fifo_q <= fifo(to_integer(fifo_rd));
 		end if;
 	end process;
 	
-	-- State machine that controls LCD
-	STATE_MACHINE : process (lcd_clk, rst, curr_state)
+	-- FIFO pointers and strobe state machine
+	STATE_MACHINE : process (clk, rst)
+		variable push : boolean;
+		variable pop  : boolean;
 	begin
 		if rst = '1' then
-			curr_state <= rst_0;
-			ctl  <= "000";
-			data <= "00000000";
+			fifo_wr    <= (others => '0');
+			fifo_rd    <= (others => '0');
+			fifo_level <= (others => '0');
+			curr_state <= idle;
+			cmd   <= (others => '0');
+			timer <= (others => '0');
+			ctl   <= "000";
+			data  <= "00000000";
 		
-		elsif rising_edge(lcd_clk) then
+		elsif rising_edge(clk) then
+			push := fifo_push = '1';
+			pop  := curr_state = idle and fifo_level /= 0;
+			
+			if push then
+				fifo_wr <= fifo_wr + 1;
+			end if;
+			
+			if push and not pop then
+				fifo_level <= fifo_level + 1;
+			elsif pop and not push then
+				fifo_level <= fifo_level - 1;
+			end if;
+			
+			if timer /= 0 then
+				timer <= timer - 1;
+			end if;
+			
 			case curr_state is
 				
-				-- Function set
-				-- Set 8-bit mode, 2-line display, 5x8 font
-				when rst_0 =>
-					curr_state <= rst_1;
-					ctl  <= "000";
-					data <= "00111000";
-				when rst_1 =>
-					curr_state <= rst_2;
-					ctl  <= "001";
-					data <= "00111000";
-				when rst_2 =>
-					curr_state <= rst_3;
-					ctl  <= "000";
-					data <= "00111000";
+				-- Pop the next command
+				when idle =>
+					if pop then
+						fifo_rd    <= fifo_rd + 1;
+						curr_state <= fetch;
+					end if;
 				
-				-- Display on/off control
-				-- Display on, cursor on, blink on
-				when rst_3 =>
-					curr_state <= rst_4;
-					ctl  <= "000";
-					data <= "00001111";
-				when rst_4 =>
-					curr_state <= rst_5;
-					ctl  <= "001";
-					data <= "00001111";
-				when rst_5 =>
-					curr_state <= rst_6;
-					ctl  <= "000";
-					data <= "00001111";
+				-- The popped command is in fifo_q now; drive RS and the data
+				-- bus, E low
+				when fetch =>
+					cmd        <= fifo_q;
+					ctl        <= fifo_q(8) & "00";
+					data       <= fifo_q(7 downto 0);
+					timer      <= to_unsigned(SETUP_CYCLES, timer'length);
+					curr_state <= setup;
 				
-				-- Entry mode set
-				-- Increment and shift cursor, don't shift entire display
-				when rst_6 =>
-					curr_state <= rst_7;
-					ctl  <= "000";
-					data <= "00000110";
-				when rst_7 =>
-					curr_state <= rst_8;
-					ctl  <= "001";
-					data <= "00000110";
-				when rst_8 =>
-					curr_state <= rst_9;
-					ctl  <= "000";
-					data <= "00000110";
+				-- Raise E once the address has settled
+				when setup =>
+					if timer = 0 then
+						ctl(0)     <= '1';
+						timer      <= to_unsigned(PULSE_CYCLES, timer'length);
+						curr_state <= pulse;
+					end if;
 				
-				-- Clear display
-				when rst_9 =>
-					curr_state <= rst_10;
-					ctl  <= "000";
-					data <= "00000001";
-				when rst_10 =>
-					curr_state <= rst_11;
-					ctl  <= "001";
-					data <= "00000001";
-				when rst_11 =>
-					curr_state <= rst_12;
-					ctl  <= "000";
-					data <= "00000001";
+				-- The LCD latches the command on the falling edge of E
+				when pulse =>
+					if timer = 0 then
+						ctl(0)     <= '0';
+						timer      <= to_unsigned(HOLD_CYCLES, timer'length);
+						curr_state <= hold;
+					end if;
 				
-				-- Return home
-				when rst_12 =>
-					curr_state <= rst_13;
-					ctl  <= "000";
-					data <= "00000010";
-				when rst_13 =>
-					curr_state <= rst_14;
-					ctl  <= "001";
-					data <= "00000010";
-				when rst_14 =>
-					curr_state <= write_0;
-					ctl  <= "000";
-					data <= "00000010";
-					
-				-- Write an R
-				when write_0 =>
-					curr_state <= write_1;
-					ctl  <= "100";
-					data <= "01010010";
-				when write_1 =>
-					curr_state <= write_2;
-					ctl  <= "101";
-					data <= "01010010";
-				when write_2 =>
-					curr_state <= idle;
-					ctl  <= "100";
-					data <= "01010010";
-					
-				-- Idle
-				when idle =>
-					curr_state <= idle;
-					ctl  <= "000";
-					data <= "00000000";
-					
-				when others =>
-					curr_state <= rst_0;
-					ctl  <= "000";
-					data <= "00000000";
-					
+				-- Hold RS and the data bus, then wait for the instruction
+				when hold =>
+					if timer = 0 then
+						ctl  <= "000";
+						data <= "00000000";
+						if cmd(8) = '1' then
+							timer <= to_unsigned(DATA_CYCLES, timer'length);
+						elsif cmd(7 downto 2) = "000000" and cmd(1 downto 0) /= "00" then
+							timer <= to_unsigned(SLOW_CYCLES, timer'length);
+						else
+							timer <= to_unsigned(INSTR_CYCLES, timer'length);
+						end if;
+						curr_state <= exec;
+					end if;
+				
+				when exec =>
+					if timer = 0 then
+						curr_state <= idle;
+					end if;
+			
 			end case;
 		end if;
 	end process;
 	
-	lcd_ctl_n <= not ctl;
+	fifo_free <= std_logic_vector(FIFO_DEPTH - fifo_level);
 	
-	lcd_data_n <= not data(0) & not data(1) & not data(2) & not data(3)
-                & not data(4) & not data(5) & not data(6) & not data(7);
+	busy <= '0' when curr_state = idle and fifo_level = 0 else '1';
 	
 end architecture;
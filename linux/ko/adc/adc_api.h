@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 or MIT */
+/*
+ * In-kernel interface of the de10nano adc driver.
+ *
+ * Other FPGA drivers include this to read the ADC without going through
+ * /dev/adc. They should look the symbol up with symbol_get() so they don't
+ * need the adc module loaded to work on their own.
+ */
+#ifndef _ADC_API_H
+#define _ADC_API_H
+
+#include <linux/types.h>
+
+#include "adc_uapi.h"
+
+/**
+ * de10nano_adc_read() - Read one ADC channel from kernel code.
+ * @channel: Channel to read, 0 to ADC_NUM_CHANNELS - 1.
+ * @value: Filled with the 12-bit channel value.
+ *
+ * Never sleeps, so it can be called from timers and other atomic contexts.
+ * The value comes from the published sample set when that is within the
+ * max_staleness_us bound, and straight from the channel register otherwise.
+ *
+ * Return: 0 on success, -EINVAL for a bad channel, or -ENODEV if no adc is
+ * bound to the driver.
+ */
+int de10nano_adc_read(unsigned int channel, u16 *value);
+
+#endif /* _ADC_API_H */
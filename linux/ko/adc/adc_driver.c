@@ -6,7 +6,23 @@
 #include <linux/types.h>
 #include <linux/mutex.h>
 #include <linux/miscdevice.h>
+#include <linux/rcupdate.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+
+#include "adc_uapi.h"
+#include "adc_api.h"
+#include "../fpga_stats.h"
 
 // ADC channel register addresses
 static u32 CH0 = 0x0;
@@ -26,15 +42,140 @@ static u32 CH7 = 0x1c;
 
 // ADC values are in the 12 least-significant bits of the registers
 #define ADC_VALUE_BITMASK 0xfff
+#define ADC_RESOLUTION_BITS 12
+
+/*
+ * The LTC2308's unipolar input range is 0 to VREFCOMP (4.096 V), not the 5 V
+ * the IP core documentation claims; see the README.
+ */
+#define ADC_VREF_MV 4096
+
+static unsigned long VOLTAGE_SCALE_MV = ADC_VREF_MV >> ADC_RESOLUTION_BITS;
+
+// Sampler ring buffer size in samples; must be a power of two for kfifo
+#define ADC_RING_SIZE 1024
+
+// Fastest rate the hrtimer sampler may be programmed to, in Hz
+#define ADC_MAX_SAMPLE_RATE 20000
+
+#define ADC_DEFAULT_WATERMARK 32
+
+// Largest accepted staleness bound of the published snapshot, in microseconds
+#define ADC_MAX_STALENESS_US 1000000
+
+// Event queue size in events; must be a power of two for kfifo
+#define ADC_EVENT_QUEUE_SIZE 256
+
+// A high threshold above every possible value, so it never trips
+#define ADC_THRESH_HIGH_OFF (ADC_VALUE_BITMASK + 1)
+
+// Default threshold hysteresis in LSB, a few counts of ADC noise
+#define ADC_DEFAULT_THRESH_HYST 8
+
+// Limits of the per-channel conditioning settings
+#define ADC_MAX_OVERSAMPLING 8
+#define ADC_MAX_FILTER_SHIFT 15
+#define ADC_MAX_DECIMATION 1024
+
+// The IIR filter state keeps this many fractional bits
+#define ADC_IIR_FRAC_BITS 16
+
+/**
+ * struct adc_channel_filter - Per-channel conditioning done by the sampler.
+ * @oversampling: log2 of the number of raw samples averaged into one value
+ * @filter_shift: IIR smoothing, y += (x - y) >> filter_shift; 0 disables it
+ * @decimation:   Only every decimation-th filtered value is output
+ * @acc:          Sum of the raw samples in the current oversampling window
+ * @acc_count:    Number of raw samples in @acc
+ * @iir:          IIR filter state in fixed point
+ * @iir_valid:    @iir has been seeded with a first value
+ * @dec_count:    Filtered values since the last output
+ *
+ * Raw sample -> 2^oversampling average -> IIR -> decimation -> ring buffer,
+ * so a channel outputs one value every 2^oversampling * decimation ticks.
+ */
+struct adc_channel_filter {
+	unsigned int oversampling;
+	unsigned int filter_shift;
+	unsigned int decimation;
+	u32 acc;
+	unsigned int acc_count;
+	s32 iir;
+	bool iir_valid;
+	unsigned int dec_count;
+};
+
+/**
+ * struct adc_channel_event - Per-channel event checks done by the sampler.
+ * @thresh_high:   Raise ADC_EVENT_HIGH when the value rises above this
+ * @thresh_low:    Raise ADC_EVENT_LOW when the value falls below this
+ * @thresh_hyst:   How far, in LSB, the value has to move back past a
+ *                 threshold before that threshold can fire again
+ * @delta:         Raise ADC_EVENT_DELTA when the value moves more than this
+ *                 many LSB from the last reported value; 0 disables it
+ * @above:         ADC_EVENT_HIGH fired and the value hasn't dropped below
+ *                 @thresh_high - @thresh_hyst since
+ * @below:         ADC_EVENT_LOW fired and the value hasn't risen above
+ *                 @thresh_low + @thresh_hyst since
+ * @last_reported: Value reported by the last delta event
+ * @last_valid:    @last_reported has been seeded
+ *
+ * Threshold events fire on the crossing only, not on every value past the
+ * threshold, so a channel resting above its high threshold stays quiet. The
+ * hysteresis keeps a noisy channel sitting right at a threshold from firing
+ * on every sample.
+ */
+struct adc_channel_event {
+	u16 thresh_high;
+	u16 thresh_low;
+	u16 thresh_hyst;
+	u16 delta;
+	bool above;
+	bool below;
+	u16 last_reported;
+	bool last_valid;
+};
 
-static unsigned long VOLTAGE_SCALE_MV = 1;
+/**
+ * struct adc_cache - Latest raw channel values, published through a seqlock.
+ * @timestamp_ns: CLOCK_MONOTONIC time the values were read
+ * @value:        Raw channel values; only channels in @valid are meaningful
+ * @valid:        Bit n is set if @value[n] was read at @timestamp_ns
+ */
+struct adc_cache {
+	u64 timestamp_ns;
+	u16 value[ADC_NUM_CHANNELS];
+	u8 valid;
+};
 
 /**
  * struct adc_dev - Private adc device struct.
- * @base_addr:   Pointer to the component's base address 
+ * @base_addr:     Pointer to the component's base address 
  * @auto_update: 
- * @miscdev:     miscdevice used to create a character device
- * @lock:        mutex used to prevent concurrent writes to memory 
+ * @miscdev:       miscdevice used to create a character device
+ * @lock:          mutex used to prevent concurrent writes to memory 
+ * @phys_addr:     Physical base address of the register window
+ * @span:          Size of the register window in bytes
+ * @sampler:       hrtimer that samples the enabled channels into @ring
+ * @sample_period: Period of @sampler; only valid while @sample_rate != 0
+ * @sample_rate:   Sampler rate in Hz; 0 means the sampler is stopped
+ * @channel_mask:  Channels the sampler reads; bit n is channel n
+ * @watermark:     Number of buffered samples that wakes stream readers
+ * @seq:           Sequence number of the next sample
+ * @overruns:      Number of samples dropped because @ring was full
+ * @ring:          Lock-free ring of samples; the sampler is the only
+ *                 producer and readers serialize on @lock to consume
+ * @wait:          Wait queue for stream readers and poll()
+ * @filter:        Conditioning settings and state of each channel
+ * @event:         Event settings and state of each channel
+ * @events:        Lock-free queue of events; the sampler produces, readers
+ *                 serialize on @lock to consume
+ * @event_overruns: Number of events dropped because @events was full
+ * @stats:         Latency and throughput counters, exposed in debugfs
+ * @cache_lock:    seqlock that publishes @cache to lockless readers
+ * @cache:         Latest channel values read by the sampler or a reader
+ * @max_staleness_ns: Oldest @cache that readers accept instead of going out
+ *                 on the bridge; 0 disables the cache
  *
  * An adc_dev struct gets created for each adc component.
  */
@@ -43,33 +184,542 @@ struct adc_dev {
 	bool auto_update;
 	struct miscdevice miscdev;
 	struct mutex lock;
+	phys_addr_t phys_addr;
+	resource_size_t span;
+	struct hrtimer sampler;
+	ktime_t sample_period;
+	unsigned int sample_rate;
+	u8 channel_mask;
+	unsigned int watermark;
+	u32 seq;
+	unsigned long overruns;
+	DECLARE_KFIFO_PTR(ring, struct adc_sample);
+	wait_queue_head_t wait;
+	struct adc_channel_filter filter[ADC_NUM_CHANNELS];
+	struct adc_channel_event event[ADC_NUM_CHANNELS];
+	DECLARE_KFIFO_PTR(events, struct adc_event);
+	unsigned long event_overruns;
+	struct fpga_stats stats;
+	seqlock_t cache_lock;
+	struct adc_cache cache;
+	u64 max_staleness_ns;
+};
+
+/*
+ * The adc bound to the driver, for de10nano_adc_read(). The board only has
+ * one; RCU lets the reader run in atomic context while remove() unpublishes it.
+ */
+static struct adc_dev __rcu *adc_api_dev;
+
+/**
+ * struct adc_file - Per-open state of the adc char device.
+ * @priv: The adc device this file was opened on.
+ * @mode: Read mode of this file, one of the ADC_MODE_* values.
+ */
+struct adc_file {
+	struct adc_dev *priv;
+	u32 mode;
 };
 
 /**
- * adc_read() - Read method for the adc char device
+ * adc_channel_read() - Read a channel register over the bridge.
+ * @priv: The adc device.
+ * @offset: Byte offset of the channel register.
+ *
+ * Return: The 12-bit channel value.
+ */
+static u16 adc_channel_read(struct adc_dev *priv, unsigned int offset)
+{
+	return fpga_stats_ioread32(&priv->stats, priv->base_addr + offset)
+	       & ADC_VALUE_BITMASK;
+}
+
+/**
+ * adc_cache_read() - Copy the published channel values.
+ * @priv: The adc device.
+ * @out: Filled with the published values.
+ *
+ * Never sleeps or touches the bridge, so it is safe from any context.
+ */
+static void adc_cache_read(struct adc_dev *priv, struct adc_cache *out)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&priv->cache_lock);
+		*out = priv->cache;
+	} while (read_seqretry(&priv->cache_lock, seq));
+}
+
+/**
+ * adc_cache_fresh() - Check whether a copy of the cache can serve a reader.
+ * @priv: The adc device.
+ * @cache: A copy of the cache.
+ * @mask: Channels the reader needs.
+ *
+ * Return: true if every channel in @mask is valid and within the bound.
+ */
+static bool adc_cache_fresh(struct adc_dev *priv,
+	const struct adc_cache *cache, u8 mask)
+{
+	return (cache->valid & mask) == mask
+	       && ktime_get_ns() - cache->timestamp_ns
+	          <= READ_ONCE(priv->max_staleness_ns);
+}
+
+/**
+ * adc_cache_get() - Get channel values from the cache, refreshing it if stale.
+ * @priv: The adc device.
+ * @mask: Channels the reader needs.
+ * @out: Filled with the channel values.
+ *
+ * Fresh values are copied without touching the bridge. When the cache is
+ * stale, the first reader to take @priv->lock reads all channels in one
+ * burst and publishes them; readers queued behind it find the cache fresh
+ * again and return without another burst. Bus traffic therefore depends on
+ * the staleness bound and not on the number of readers.
+ *
+ * Return: false if the cache is disabled and @out was not filled.
+ */
+static bool adc_cache_get(struct adc_dev *priv, u8 mask,
+	struct adc_cache *out)
+{
+	struct adc_cache fresh;
+	unsigned int ch;
+
+	if (!READ_ONCE(priv->max_staleness_ns)) {
+		return false;
+	}
+
+	adc_cache_read(priv, out);
+	if (adc_cache_fresh(priv, out, mask)) {
+		return true;
+	}
+
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	adc_cache_read(priv, out);
+	if (!adc_cache_fresh(priv, out, mask)) {
+		fresh.timestamp_ns = ktime_get_ns();
+		for (ch = 0; ch < ADC_NUM_CHANNELS; ch++) {
+			fresh.value[ch] = adc_channel_read(priv, ch * 4);
+		}
+		fresh.valid = GENMASK(ADC_NUM_CHANNELS - 1, 0);
+
+		// The sampler publishes from softirq context on this CPU too
+		write_seqlock_bh(&priv->cache_lock);
+		priv->cache = fresh;
+		write_sequnlock_bh(&priv->cache_lock);
+		*out = fresh;
+	}
+	mutex_unlock(&priv->lock);
+
+	return true;
+}
+
+int de10nano_adc_read(unsigned int channel, u16 *value)
+{
+	struct adc_dev *priv;
+	struct adc_cache cache;
+
+	if (channel >= ADC_NUM_CHANNELS) {
+		return -EINVAL;
+	}
+
+	rcu_read_lock();
+	priv = rcu_dereference(adc_api_dev);
+	if (!priv) {
+		rcu_read_unlock();
+		return -ENODEV;
+	}
+
+	adc_cache_read(priv, &cache);
+	if (READ_ONCE(priv->max_staleness_ns)
+	    && adc_cache_fresh(priv, &cache, BIT(channel))) {
+		*value = cache.value[channel];
+	} else {
+		*value = adc_channel_read(priv, channel * 4);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(de10nano_adc_read);
+
+/**
+ * adc_filter_reset() - Drop a channel's partially accumulated state.
+ * @filter: The channel's filter.
+ */
+static void adc_filter_reset(struct adc_channel_filter *filter)
+{
+	filter->acc = 0;
+	filter->acc_count = 0;
+	filter->iir_valid = false;
+	filter->dec_count = 0;
+}
+
+/**
+ * adc_filter_run() - Feed one raw sample through a channel's conditioning.
+ * @filter: The channel's filter.
+ * @raw: The raw 12-bit sample.
+ * @out: Set to the conditioned value when one is produced.
+ *
+ * Return: true if @out holds a new output value.
+ */
+static bool adc_filter_run(struct adc_channel_filter *filter, u16 raw, u16 *out)
+{
+	s32 x;
+
+	filter->acc += raw;
+	if (++filter->acc_count < (1U << filter->oversampling)) {
+		return false;
+	}
+	x = (s32)(filter->acc >> filter->oversampling) << ADC_IIR_FRAC_BITS;
+	filter->acc = 0;
+	filter->acc_count = 0;
+
+	if (filter->filter_shift == 0 || !filter->iir_valid) {
+		filter->iir = x;
+		filter->iir_valid = true;
+	} else {
+		filter->iir += (x - filter->iir) >> filter->filter_shift;
+	}
+
+	if (++filter->dec_count < filter->decimation) {
+		return false;
+	}
+	filter->dec_count = 0;
+
+	// Round to the nearest LSB.
+	*out = (filter->iir + BIT(ADC_IIR_FRAC_BITS - 1)) >> ADC_IIR_FRAC_BITS;
+	return true;
+}
+
+/**
+ * adc_event_push() - Queue an event for readers in ADC_MODE_EVENTS.
+ * @priv: The adc device.
+ * @ch: Channel that tripped.
+ * @type: One of the ADC_EVENT_* types.
+ * @value: Value that tripped the event.
+ * @timestamp_ns: Time of the sample.
+ */
+static void adc_event_push(struct adc_dev *priv, unsigned int ch,
+	u16 type, u16 value, s64 timestamp_ns)
+{
+	struct adc_event event = {
+		.timestamp_ns = timestamp_ns,
+		.channel = ch,
+		.type = type,
+		.value = value,
+	};
+
+	if (!kfifo_put(&priv->events, event)) {
+		priv->event_overruns++;
+	}
+}
+
+/**
+ * adc_events_check() - Run a channel's threshold and delta checks.
+ * @priv: The adc device.
+ * @ch: The channel.
+ * @value: The channel's new conditioned value.
+ * @timestamp_ns: Time of the sample.
+ *
+ * Return: true if at least one event was raised.
+ */
+static bool adc_events_check(struct adc_dev *priv, unsigned int ch,
+	u16 value, s64 timestamp_ns)
+{
+	struct adc_channel_event *event = &priv->event[ch];
+	u16 high = READ_ONCE(event->thresh_high);
+	u16 low = READ_ONCE(event->thresh_low);
+	int hyst = READ_ONCE(event->thresh_hyst);
+	u16 delta = READ_ONCE(event->delta);
+	bool raised = false;
+
+	if (event->above) {
+		event->above = (int)value >= (int)high - hyst;
+	} else if (value > high) {
+		adc_event_push(priv, ch, ADC_EVENT_HIGH, value, timestamp_ns);
+		event->above = true;
+		raised = true;
+	}
+
+	if (event->below) {
+		event->below = (int)value <= (int)low + hyst;
+	} else if (value < low) {
+		adc_event_push(priv, ch, ADC_EVENT_LOW, value, timestamp_ns);
+		event->below = true;
+		raised = true;
+	}
+
+	if (!event->last_valid) {
+		event->last_reported = value;
+		event->last_valid = true;
+	} else if (delta && abs((int)value - (int)event->last_reported) > delta) {
+		adc_event_push(priv, ch, ADC_EVENT_DELTA, value, timestamp_ns);
+		event->last_reported = value;
+		raised = true;
+	}
+
+	return raised;
+}
+
+/**
+ * adc_sampler_fn() - Sample the enabled channels into the ring buffer.
+ * @timer: The adc device's sampler hrtimer.
+ *
+ * Runs in softirq context at the configured sample rate. Every enabled
+ * channel is read once per tick and run through its conditioning; a record is
+ * pushed whenever at least one channel produced an output, with channel_mask
+ * saying which. Each new output is also run through the channel's event
+ * checks. When the ring buffer is full the record is dropped and counted as
+ * an overrun; the sequence number still advances so readers can see the gap.
+ * The raw values are also published to the snapshot cache.
+ *
+ * Return: HRTIMER_RESTART, the sampler keeps running until it is cancelled.
+ */
+static enum hrtimer_restart adc_sampler_fn(struct hrtimer *timer)
+{
+	struct adc_dev *priv = container_of(timer, struct adc_dev, sampler);
+	struct adc_sample sample = { 0 };
+	struct adc_cache cache = { 0 };
+	u8 mask = READ_ONCE(priv->channel_mask);
+	unsigned int ch;
+	bool raised = false;
+	u16 raw;
+
+	sample.timestamp_ns = ktime_get_ns();
+	cache.timestamp_ns = sample.timestamp_ns;
+
+	for (ch = 0; ch < ADC_NUM_CHANNELS; ch++) {
+		if (!(mask & BIT(ch))) {
+			continue;
+		}
+		raw = adc_channel_read(priv, ch * 4);
+		cache.value[ch] = raw;
+		cache.valid |= BIT(ch);
+		if (adc_filter_run(&priv->filter[ch], raw, &sample.value[ch])) {
+			sample.channel_mask |= BIT(ch);
+			raised |= adc_events_check(priv, ch, sample.value[ch],
+			                           sample.timestamp_ns);
+		}
+	}
+
+	if (cache.valid) {
+		write_seqlock(&priv->cache_lock);
+		priv->cache = cache;
+		write_sequnlock(&priv->cache_lock);
+	}
+
+	if (sample.channel_mask) {
+		sample.seq = priv->seq++;
+		if (!kfifo_put(&priv->ring, sample)) {
+			priv->overruns++;
+		}
+	}
+
+	if (raised || kfifo_len(&priv->ring) >= priv->watermark) {
+		wake_up_interruptible(&priv->wait);
+	}
+
+	hrtimer_forward_now(timer, priv->sample_period);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * adc_stream_ready() - Check whether a stream reader should wake up.
+ * @priv: The adc device.
+ *
+ * Readers wake once the watermark is reached. After the sampler has been
+ * stopped, whatever is left in the ring is handed out as well so readers
+ * don't wait forever on a partial block.
+ *
+ * Return: true if a stream read would not block.
+ */
+static bool adc_stream_ready(struct adc_dev *priv)
+{
+	unsigned int len = kfifo_len(&priv->ring);
+
+	return len >= priv->watermark || (READ_ONCE(priv->sample_rate) == 0);
+}
+
+/**
+ * adc_stream_read() - Drain whole samples from the ring buffer.
+ * @priv: The adc device.
+ * @file: The char device file, used for O_NONBLOCK.
+ * @buf: User-space buffer to copy the samples into.
+ * @count: Size of @buf; only whole struct adc_sample records are copied.
+ *
+ * Return: The number of bytes copied, 0 if the sampler is stopped and the
+ * ring is empty, or a negative error value.
+ */
+static ssize_t adc_stream_read(struct adc_dev *priv, struct file *file,
+	char __user *buf, size_t count)
+{
+	unsigned int copied;
+	int ret;
+
+	if (count < sizeof(struct adc_sample)) {
+		return -EINVAL;
+	}
+
+	if (!adc_stream_ready(priv)) {
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(priv->wait,
+		                               adc_stream_ready(priv));
+		if (ret) {
+			return ret;
+		}
+	}
+
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	ret = kfifo_to_user(&priv->ring, buf, count, &copied);
+	mutex_unlock(&priv->lock);
+
+	return ret ? ret : copied;
+}
+
+/**
+ * adc_event_read() - Drain whole events from the event queue.
+ * @priv: The adc device.
+ * @file: The char device file, used for O_NONBLOCK.
+ * @buf: User-space buffer to copy the events into.
+ * @count: Size of @buf; only whole struct adc_event records are copied.
+ *
+ * Blocks until at least one event has fired.
+ *
+ * Return: The number of bytes copied, or a negative error value.
+ */
+static ssize_t adc_event_read(struct adc_dev *priv, struct file *file,
+	char __user *buf, size_t count)
+{
+	unsigned int copied;
+	int ret;
+
+	if (count < sizeof(struct adc_event)) {
+		return -EINVAL;
+	}
+
+	if (kfifo_is_empty(&priv->events)) {
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(priv->wait,
+		                               !kfifo_is_empty(&priv->events));
+		if (ret) {
+			return ret;
+		}
+	}
+
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	ret = kfifo_to_user(&priv->events, buf, count, &copied);
+	mutex_unlock(&priv->lock);
+
+	return ret ? ret : copied;
+}
+
+/**
+ * adc_sampler_set_rate() - Start, stop, or retune the sampler.
+ * @priv: The adc device.
+ * @rate: New sample rate in Hz; 0 stops the sampler.
+ *
+ * Must be called with @priv->lock held.
+ */
+static void adc_sampler_set_rate(struct adc_dev *priv, unsigned int rate)
+{
+	hrtimer_cancel(&priv->sampler);
+	WRITE_ONCE(priv->sample_rate, rate);
+
+	if (rate) {
+		priv->sample_period = ns_to_ktime(NSEC_PER_SEC / rate);
+		hrtimer_start(&priv->sampler, priv->sample_period,
+		              HRTIMER_MODE_REL_SOFT);
+	}
+
+	// Let blocked readers pick up a partial block or see the end of stream.
+	wake_up_interruptible(&priv->wait);
+}
+
+/**
+ * adc_open() - Open method for the adc char device
+ * @inode: Inode of the char device.
+ * @file: Pointer to the char device file struct.
+ *
+ * Allocates the per-open state; every file starts in ADC_MODE_REGS.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int adc_open(struct inode *inode, struct file *file)
+{
+	struct adc_file *afile;
+
+	afile = kzalloc(sizeof(*afile), GFP_KERNEL);
+	if (!afile) {
+		return -ENOMEM;
+	}
+
+	/*
+	 * The misc core sets the file struct's private_data field to our
+	 * miscdev before calling open. container_of returns the adc_dev
+	 * struct that contains that miscdev; we keep it in the per-open state
+	 * which replaces private_data for the rest of the file's lifetime.
+	 */
+	afile->priv = container_of(file->private_data, struct adc_dev,
+	                           miscdev);
+	afile->mode = ADC_MODE_REGS;
+	file->private_data = afile;
+
+	return 0;
+}
+
+/**
+ * adc_release() - Release method for the adc char device
+ * @inode: Inode of the char device.
+ * @file: Pointer to the char device file struct.
+ *
+ * Return: 0.
+ */
+static int adc_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+/**
+ * adc_do_read() - Read method for the adc char device
  * @file: Pointer to the char device file struct.
  * @buf: User-space buffer to read the value into.
  * @count: The number of bytes being requested.
  * @offset: The byte offset in the file being read from.
  *
+ * In ADC_MODE_REGS, every whole register from @offset up to @count bytes or
+ * the end of the device is returned in a single copy, so one read() or
+ * pread() at offset 0 with a count of SPAN returns all eight channels.
+ *
  * Return: On success, the number of bytes written is returned and the
  * offset @offset is advanced by this number. On error, a negative error
  * value is returned.
  */
-static ssize_t adc_read(struct file *file, char __user *buf,
+static ssize_t adc_do_read(struct file *file, char __user *buf,
 	size_t count, loff_t *offset)
 {
 	size_t ret;
-	u32 val;
+	u32 vals[ADC_NUM_CHANNELS];
+	struct adc_cache cache;
+	unsigned int first;
+	unsigned int i;
 
-	/*
-	 * Get the device's private data from the file struct's private_data
-	 * field. The private_data field is equal to the miscdev field in the
-	 * adc_dev struct. container_of returns the 
-     * adc_dev struct that contains the miscdev in private_data.
-	 */
-	struct adc_dev *priv = container_of(file->private_data,
-	                            struct adc_dev, miscdev);
+	struct adc_file *afile = file->private_data;
+	struct adc_dev *priv = afile->priv;
+
+	if (afile->mode == ADC_MODE_STREAM) {
+		return adc_stream_read(priv, file, buf, count);
+	}
+	if (afile->mode == ADC_MODE_EVENTS) {
+		return adc_event_read(priv, file, buf, count);
+	}
 
 	// Check file offset to make sure we are reading from a valid location.
 	if (*offset < 0) {
@@ -86,202 +736,991 @@ static ssize_t adc_read(struct file *file, char __user *buf,
 		return -EFAULT;
 	}
 
-	val = ioread32(priv->base_addr + *offset) & ADC_VALUE_BITMASK;
+	// Only whole registers are read, and never past the end of the device.
+	count = min_t(size_t, count, SPAN - *offset) & ~(size_t)0x3;
+	if (count == 0) {
+		return -EINVAL;
+	}
+
+	first = *offset / sizeof(u32);
+	if (adc_cache_get(priv, GENMASK(first + count / sizeof(u32) - 1, first),
+	                  &cache)) {
+		for (i = 0; i < count / sizeof(u32); i++) {
+			vals[i] = cache.value[first + i];
+		}
+	} else {
+		for (i = 0; i < count / sizeof(u32); i++) {
+			vals[i] = adc_channel_read(priv, *offset + i * sizeof(u32));
+		}
+	}
+
+	// Copy the values to userspace.
+	ret = copy_to_user(buf, vals, count);
+	if (ret) {
+		pr_warn("adc_read: copy to userspace failed\n");
+		return -EFAULT;
+	}
+
+	// Increment the file offset by the number of bytes we read.
+	*offset = *offset + count;
+
+	return count;
+}
+
+/**
+ * adc_do_write() - Write method for the adc char device
+ * @file: Pointer to the char device file struct.
+ * @buf: User-space buffer to read the value from.
+ * @count: The number of bytes being written.
+ * @offset: The byte offset in the file being written to.
+ *
+ * Return: On success, the number of bytes written is returned and the
+ * offset @offset is advanced by this number. On error, a negative error
+ * value is returned.
+ */
+static ssize_t adc_do_write(struct file *file, const char __user *buf,
+	size_t count, loff_t *offset)
+{
+	size_t ret;
+	u32 val;
+
+	struct adc_file *afile = file->private_data;
+	struct adc_dev *priv = afile->priv;
+
+	if (*offset < 0) {
+		return -EINVAL;
+	}
+	if (*offset >= AUTO_UPDATE) {
+		// can't write past to the read-only adc channel registers
+		return -EINVAL;
+	}
+	if ((*offset % 0x4) != 0) {
+		pr_warn("adc_write: unaligned access\n");
+		return -EFAULT;
+	}
+
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+
+	// Get the value from userspace.
+	ret = copy_from_user(&val, buf, sizeof(val));
+	if (ret != sizeof(val)) {
+		fpga_stats_iowrite32(&priv->stats, val, priv->base_addr + *offset);
+
+		// Increment the file offset by the number of bytes we wrote.
+		*offset = *offset + sizeof(val);
+
+		// Return the number of bytes we wrote.
+		ret = sizeof(val);
+	}
+	else {
+		pr_warn("adc_write: nothing copied from user space\n");
+		ret = -EFAULT;
+	}
+
+	mutex_unlock(&priv->lock);
+	return ret;
+}
+
+/**
+ * adc_poll() - Poll method for the adc char device
+ * @file: Pointer to the char device file struct.
+ * @wait: Poll table.
+ *
+ * Register reads never block, so files in ADC_MODE_REGS are always ready.
+ * Stream files become readable once the sampler has filled the ring buffer
+ * up to the watermark, and event files once an event has fired.
+ *
+ * Return: The poll mask.
+ */
+static __poll_t adc_poll(struct file *file, poll_table *wait)
+{
+	struct adc_file *afile = file->private_data;
+	struct adc_dev *priv = afile->priv;
+
+	if (afile->mode == ADC_MODE_REGS) {
+		return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+	}
+
+	poll_wait(file, &priv->wait, wait);
+
+	if (afile->mode == ADC_MODE_EVENTS) {
+		return kfifo_is_empty(&priv->events) ? 0 : EPOLLIN | EPOLLRDNORM;
+	}
+
+	if (adc_stream_ready(priv)) {
+		return EPOLLIN | EPOLLRDNORM;
+	}
+
+	return 0;
+}
+
+/**
+ * adc_do_ioctl() - Ioctl method for the adc char device
+ * @file: Pointer to the char device file struct.
+ * @cmd: One of the ADC_IOC_* commands from adc_uapi.h.
+ * @arg: Command argument.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static long adc_do_ioctl(struct file *file, unsigned int cmd,
+	unsigned long arg)
+{
+	struct adc_file *afile = file->private_data;
+	struct adc_dev *priv = afile->priv;
+	struct adc_snapshot snap;
+	struct adc_cache cache;
+	unsigned int ch;
+
+	switch (cmd) {
+	case ADC_IOC_SNAPSHOT:
+		if (copy_from_user(&snap, (void __user *)arg, sizeof(snap))) {
+			return -EFAULT;
+		}
+		if ((snap.channel_mask & ~GENMASK(ADC_NUM_CHANNELS - 1, 0)) ||
+		    snap.reserved) {
+			return -EINVAL;
+		}
+
+		// Cached values also come from one burst, so they qualify.
+		if (adc_cache_get(priv, snap.channel_mask, &cache)) {
+			snap.timestamp_ns = cache.timestamp_ns;
+			for (ch = 0; ch < ADC_NUM_CHANNELS; ch++) {
+				snap.value[ch] = snap.channel_mask & BIT(ch)
+				                 ? cache.value[ch] : 0;
+			}
+			goto copy_out;
+		}
+
+		/*
+		 * Hold the lock across all the channel reads so no other
+		 * snapshot or register write lands in between; the values
+		 * then come from one back-to-back burst on the bridge.
+		 */
+		fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+		snap.timestamp_ns = ktime_get_ns();
+		for (ch = 0; ch < ADC_NUM_CHANNELS; ch++) {
+			if (snap.channel_mask & BIT(ch)) {
+				snap.value[ch] = adc_channel_read(priv, ch * 4);
+			} else {
+				snap.value[ch] = 0;
+			}
+		}
+		mutex_unlock(&priv->lock);
+copy_out:
+		if (copy_to_user((void __user *)arg, &snap, sizeof(snap))) {
+			return -EFAULT;
+		}
+		return 0;
+	case ADC_IOC_SET_MODE:
+		if (arg != ADC_MODE_REGS && arg != ADC_MODE_STREAM
+		    && arg != ADC_MODE_EVENTS) {
+			return -EINVAL;
+		}
+		afile->mode = arg;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * The read, write, and ioctl entry points time the whole syscall, including
+ * any sleep in a blocking stream or event read, into the device's stats.
+ */
+static ssize_t adc_read(struct file *file, char __user *buf,
+	size_t count, loff_t *offset)
+{
+	struct adc_file *afile = file->private_data;
+	u64 start = fpga_stats_start(&afile->priv->stats);
+	ssize_t ret = adc_do_read(file, buf, count, offset);
+
+	fpga_stats_end(&afile->priv->stats, FPGA_STAT_READ, start);
+	return ret;
+}
+
+static ssize_t adc_write(struct file *file, const char __user *buf,
+	size_t count, loff_t *offset)
+{
+	struct adc_file *afile = file->private_data;
+	u64 start = fpga_stats_start(&afile->priv->stats);
+	ssize_t ret = adc_do_write(file, buf, count, offset);
+
+	fpga_stats_end(&afile->priv->stats, FPGA_STAT_WRITE, start);
+	return ret;
+}
+
+static long adc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct adc_file *afile = file->private_data;
+	u64 start = fpga_stats_start(&afile->priv->stats);
+	long ret = adc_do_ioctl(file, cmd, arg);
+
+	fpga_stats_end(&afile->priv->stats, FPGA_STAT_IOCTL, start);
+	return ret;
+}
+
+/**
+ * adc_mmap() - Mmap method for the adc char device
+ * @file: Pointer to the char device file struct.
+ * @vma:  Userspace mapping being set up.
+ *
+ * Maps the ADC's register window into userspace, uncached, so channels can
+ * be read at bus speed without a syscall per access. Mappings are page
+ * granular, so the window must start on a page boundary and fill whole
+ * pages; otherwise the mapping would also expose whichever components share
+ * the page. Windows smaller than a page are refused with -EINVAL, and
+ * programs use read() instead.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int adc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct adc_file *afile = file->private_data;
+	struct adc_dev *priv = afile->priv;
+	unsigned long pages = priv->span >> PAGE_SHIFT;
+
+	if (!(vma->vm_flags & VM_SHARED) || !PAGE_ALIGNED(priv->phys_addr) ||
+		!PAGE_ALIGNED(priv->span)) {
+		return -EINVAL;
+	}
+	if (vma->vm_pgoff >= pages || vma_pages(vma) > pages - vma->vm_pgoff) {
+		return -EINVAL;
+	}
+
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	return vm_iomap_memory(vma, priv->phys_addr, priv->span);
+}
+
+/** 
+ *  adc_fops - File operations supported by the  
+ *                          adc driver
+ * @owner: The adc driver owns the file operations; this 
+ *         ensures that the driver can't be removed while the 
+ *         character device is still in use.
+ * @open: Allocates the per-open state.
+ * @release: Frees the per-open state.
+ * @read: The read function.
+ * @write: The write function.
+ * @poll: Reports stream readiness.
+ * @unlocked_ioctl: Selects the read mode.
+ * @mmap: Maps the register window into userspace.
+ * @llseek: We use the kernel's default_llseek() function; this allows 
+ *          users to change what position they are writing/reading to/from.
+ */
+static const struct file_operations  adc_fops = {
+	.owner = THIS_MODULE,
+	.open = adc_open,
+	.release = adc_release,
+	.read = adc_read,
+	.write = adc_write,
+	.poll = adc_poll,
+	.unlocked_ioctl = adc_ioctl,
+	.mmap = adc_mmap,
+	.llseek = default_llseek,
+};
+
+/**
+ * XXX: both update and auto_update appear to be useless. The ADC *always*
+ * auto updates regardless of what settings are used. Not that we can tell
+ * what settings are used since the registers are read-only... :^| stupid!!!
+ * Setting auto_update does set bit 15 high as a "refresh flag" as described
+ * in the VHDL component's datasheet, but the values update every time you read
+ * a channel register even when auto_update is off and bit 15 is low.
+ * (╯°□°）╯︵ ┻━┻
+ * Whatever... the adc channels update when we read, so that's all we want...
+ */
+/**
+ * update_store() - Start new ADC conversions.
+ * 
+ * Writing *any* value to the update register triggers an update.
+ * 
+ * @dev: Device structure for the adc component. This 
+ *       device struct is embedded in the adc's platform 
+ *       device struct.
+ * @attr: Unused.
+ * @buf: Buffer that contains the value being written.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored.
+ */
+static ssize_t update_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	/* 
+	 * Since writing any value to the update register triggers an update,
+	 * it doesn't matter what we write or what the user writes. So we ignore
+	 * what the user wants to write and just write a 1 :)
+	 */
+	fpga_stats_iowrite32(&priv->stats, 1, priv->base_addr + UPDATE);
+
+	return 4;
+}
+
+/**
+ * auto_update_store() - Enable/disable auto-update
+ * 
+ * @dev: Device structure for the adc component. 
+ * @attr: Unused.
+ * @buf: Buffer that contains the value being written.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored.
+ */
+static ssize_t auto_update_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+
+	int ret;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	ret = kstrtobool(buf, &(priv->auto_update));
+	if (ret < 0) {
+		return ret;
+	}
+
+	fpga_stats_iowrite32(&priv->stats, priv->auto_update,
+	                     priv->base_addr + AUTO_UPDATE);
+
+	return size;
+}
+
+/**
+ * auto_update_show() - Read the auto_update setting.
+ * @dev: Device structure for the adc component. 
+ * @attr: Unused.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t auto_update_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	/*
+	 * The auto_update register is actually a write-only register (dumb!), so
+	 * we return our shadow copy.
+	 */
+	return scnprintf(buf, PAGE_SIZE, "%u\n", priv->auto_update);
+}
+
+/**
+ * sample_rate_store() - Start, stop, or retune the hrtimer sampler.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
+ * @buf: Buffer that contains the rate in Hz; 0 stops the sampler.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t sample_rate_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int rate;
+	int ret;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	ret = kstrtouint(buf, 0, &rate);
+	if (ret < 0) {
+		return ret;
+	}
+	if (rate > ADC_MAX_SAMPLE_RATE) {
+		return -EINVAL;
+	}
+
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	adc_sampler_set_rate(priv, rate);
+	mutex_unlock(&priv->lock);
+
+	return size;
+}
+
+/**
+ * sample_rate_show() - Read the sampler rate in Hz.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t sample_rate_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", priv->sample_rate);
+}
+
+/**
+ * channel_mask_store() - Select which channels the sampler reads.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
+ * @buf: Buffer that contains the channel bitmask; bit n is channel n.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t channel_mask_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	u8 mask;
+	int ret;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	ret = kstrtou8(buf, 0, &mask);
+	if (ret < 0) {
+		return ret;
+	}
+	if (mask == 0) {
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(priv->channel_mask, mask);
+
+	return size;
+}
+
+/**
+ * channel_mask_show() - Read the sampler's channel bitmask.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t channel_mask_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "0x%02x\n", priv->channel_mask);
+}
+
+/**
+ * watermark_store() - Set the ring fill level that wakes stream readers.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
+ * @buf: Buffer that contains the watermark in samples.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t watermark_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int watermark;
+	int ret;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	ret = kstrtouint(buf, 0, &watermark);
+	if (ret < 0) {
+		return ret;
+	}
+	if (watermark == 0 || watermark > ADC_RING_SIZE) {
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(priv->watermark, watermark);
+	wake_up_interruptible(&priv->wait);
+
+	return size;
+}
+
+/**
+ * watermark_show() - Read the ring fill level that wakes stream readers.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t watermark_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", priv->watermark);
+}
+
+/**
+ * overruns_show() - Read the number of samples dropped on a full ring.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t overruns_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(priv->overruns));
+}
+
+/**
+ * adc_ch_show() - Read ADC channel value.
+ * 
+ * @dev: Device structure for the adc component. 
+ * @attr: Which adc channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t adc_ch_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	u16 adc_value;
+	struct adc_cache cache;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	struct dev_ext_attribute *ch_attr = container_of(attr, 
+		struct dev_ext_attribute, attr);
+
+	u32 ch_offset = *(u32 *)(ch_attr->var);
+
+	if (adc_cache_get(priv, BIT(ch_offset / 4), &cache)) {
+		adc_value = cache.value[ch_offset / 4];
+	} else {
+		adc_value = adc_channel_read(priv, ch_offset);
+	}
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", adc_value);
+}
+
+/**
+ * adc_attr_channel() - Get the channel an extended channel attribute is for.
+ * @attr: A channel attribute created with one of the DEVICE_ADC_CH_* macros.
+ *
+ * Return: The channel number.
+ */
+static unsigned int adc_attr_channel(struct device_attribute *attr)
+{
+	struct dev_ext_attribute *ch_attr = container_of(attr,
+		struct dev_ext_attribute, attr);
+
+	return *(u32 *)(ch_attr->var) / 4;
+}
+
+/**
+ * adc_ch_filter_store() - Change one conditioning setting of a channel.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the new setting.
+ * @setting: Pointer to the setting inside the channel's filter.
+ * @lo: Smallest accepted value.
+ * @hi: Largest accepted value.
+ *
+ * The sampler is paused while the setting changes and the channel's
+ * partially accumulated state is dropped, so no output mixes old and new
+ * settings.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int adc_ch_filter_store(struct device *dev,
+	struct device_attribute *attr, const char *buf,
+	unsigned int *setting, unsigned int lo, unsigned int hi)
+{
+	unsigned int val;
+	int ret;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret < 0) {
+		return ret;
+	}
+	if (val < lo || val > hi) {
+		return -EINVAL;
+	}
+
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	hrtimer_cancel(&priv->sampler);
+	*setting = val;
+	adc_filter_reset(&priv->filter[adc_attr_channel(attr)]);
+	adc_sampler_set_rate(priv, priv->sample_rate);
+	mutex_unlock(&priv->lock);
+
+	return 0;
+}
+
+/**
+ * adc_ch_oversampling_show() - Read log2 of a channel's oversampling ratio.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t adc_ch_oversampling_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 priv->filter[adc_attr_channel(attr)].oversampling);
+}
+
+/**
+ * adc_ch_oversampling_store() - Set log2 of a channel's oversampling ratio.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains n; 2^n raw samples are averaged per value.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t adc_ch_oversampling_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+	int ret;
+
+	ret = adc_ch_filter_store(dev, attr, buf,
+	                          &priv->filter[adc_attr_channel(attr)].oversampling,
+	                          0, ADC_MAX_OVERSAMPLING);
+
+	return ret ? ret : size;
+}
+
+/**
+ * adc_ch_filter_shift_show() - Read a channel's IIR filter shift.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t adc_ch_filter_shift_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 priv->filter[adc_attr_channel(attr)].filter_shift);
+}
+
+/**
+ * adc_ch_filter_shift_store() - Set a channel's IIR filter shift.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the shift; the filter's time constant is
+ *       about 2^shift outputs, and 0 disables the filter.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t adc_ch_filter_shift_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+	int ret;
+
+	ret = adc_ch_filter_store(dev, attr, buf,
+	                          &priv->filter[adc_attr_channel(attr)].filter_shift,
+	                          0, ADC_MAX_FILTER_SHIFT);
+
+	return ret ? ret : size;
+}
+
+/**
+ * adc_ch_decimation_show() - Read a channel's decimation factor.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t adc_ch_decimation_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 priv->filter[adc_attr_channel(attr)].decimation);
+}
+
+/**
+ * adc_ch_decimation_store() - Set a channel's decimation factor.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the factor; 1 outputs every filtered value.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t adc_ch_decimation_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+	int ret;
+
+	ret = adc_ch_filter_store(dev, attr, buf,
+	                          &priv->filter[adc_attr_channel(attr)].decimation,
+	                          1, ADC_MAX_DECIMATION);
+
+	return ret ? ret : size;
+}
+
+/**
+ * adc_ch_event_store() - Change one event setting of a channel.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the new setting.
+ * @setting: Pointer to the setting inside the channel's event state.
+ * @hi: Largest accepted value.
+ *
+ * The sampler reads the settings locklessly; the crossing state is re-armed
+ * so the new setting is evaluated from the next value on.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int adc_ch_event_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, u16 *setting, u16 hi)
+{
+	u16 val;
+	int ret;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+	struct adc_channel_event *event = &priv->event[adc_attr_channel(attr)];
+
+	ret = kstrtou16(buf, 0, &val);
+	if (ret < 0) {
+		return ret;
+	}
+	if (val > hi) {
+		return -EINVAL;
+	}
+
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	hrtimer_cancel(&priv->sampler);
+	*setting = val;
+	event->above = false;
+	event->below = false;
+	event->last_valid = false;
+	adc_sampler_set_rate(priv, priv->sample_rate);
+	mutex_unlock(&priv->lock);
+
+	return 0;
+}
+
+/**
+ * adc_ch_thresh_high_show() - Read a channel's high threshold.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t adc_ch_thresh_high_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 priv->event[adc_attr_channel(attr)].thresh_high);
+}
+
+/**
+ * adc_ch_thresh_high_store() - Set a channel's high threshold.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the threshold; 4096 disables it.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t adc_ch_thresh_high_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+	int ret;
+
+	ret = adc_ch_event_store(dev, attr, buf,
+	                         &priv->event[adc_attr_channel(attr)].thresh_high,
+	                         ADC_THRESH_HIGH_OFF);
 
-	// Copy the value to userspace.
-	ret = copy_to_user(buf, &val, sizeof(val));
-	if (ret == sizeof(val)) {
-		pr_warn("adc_read: nothing copied\n");
-		return -EFAULT;
-	}
+	return ret ? ret : size;
+}
 
-	// Increment the file offset by the number of bytes we read.
-	*offset = *offset + sizeof(val);
+/**
+ * adc_ch_thresh_low_show() - Read a channel's low threshold.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t adc_ch_thresh_low_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
 
-	return sizeof(val);
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 priv->event[adc_attr_channel(attr)].thresh_low);
 }
 
 /**
- * adc_write() - Write method for the adc char device
- * @file: Pointer to the char device file struct.
- * @buf: User-space buffer to read the value from.
- * @count: The number of bytes being written.
- * @offset: The byte offset in the file being written to.
+ * adc_ch_thresh_low_store() - Set a channel's low threshold.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the threshold; 0 disables it.
+ * @size: The number of bytes being written.
  *
- * Return: On success, the number of bytes written is returned and the
- * offset @offset is advanced by this number. On error, a negative error
- * value is returned.
+ * Return: The number of bytes stored, or a negative error value.
  */
-static ssize_t adc_write(struct file *file, const char __user *buf,
-	size_t count, loff_t *offset)
+static ssize_t adc_ch_thresh_low_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
 {
-	size_t ret;
-	u32 val;
+	struct adc_dev *priv = dev_get_drvdata(dev);
+	int ret;
 
-	struct adc_dev *priv = container_of(file->private_data,
-	                              struct adc_dev, miscdev);
+	ret = adc_ch_event_store(dev, attr, buf,
+	                         &priv->event[adc_attr_channel(attr)].thresh_low,
+	                         ADC_VALUE_BITMASK);
 
-	if (*offset < 0) {
-		return -EINVAL;
-	}
-	if (*offset >= AUTO_UPDATE) {
-		// can't write past to the read-only adc channel registers
-		return -EINVAL;
-	}
-	if ((*offset % 0x4) != 0) {
-		pr_warn("adc_write: unaligned access\n");
-		return -EFAULT;
-	}
+	return ret ? ret : size;
+}
 
-	mutex_lock(&priv->lock);
+/**
+ * adc_ch_thresh_hyst_show() - Read a channel's threshold hysteresis.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
+ */
+static ssize_t adc_ch_thresh_hyst_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
 
-	// Get the value from userspace.
-	ret = copy_from_user(&val, buf, sizeof(val));
-	if (ret != sizeof(val)) {
-		iowrite32(val, priv->base_addr + *offset);
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 priv->event[adc_attr_channel(attr)].thresh_hyst);
+}
 
-		// Increment the file offset by the number of bytes we wrote.
-		*offset = *offset + sizeof(val);
+/**
+ * adc_ch_thresh_hyst_store() - Set a channel's threshold hysteresis.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the hysteresis in LSB; 0 disables it.
+ * @size: The number of bytes being written.
+ *
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t adc_ch_thresh_hyst_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+	int ret;
 
-		// Return the number of bytes we wrote.
-		ret = sizeof(val);
-	}
-	else {
-		pr_warn("adc_write: nothing copied from user space\n");
-		ret = -EFAULT;
-	}
+	ret = adc_ch_event_store(dev, attr, buf,
+	                         &priv->event[adc_attr_channel(attr)].thresh_hyst,
+	                         ADC_VALUE_BITMASK);
 
-	mutex_unlock(&priv->lock);
-	return ret;
+	return ret ? ret : size;
 }
 
-/** 
- *  adc_fops - File operations supported by the  
- *                          adc driver
- * @owner: The adc driver owns the file operations; this 
- *         ensures that the driver can't be removed while the 
- *         character device is still in use.
- * @read: The read function.
- * @write: The write function.
- * @llseek: We use the kernel's default_llseek() function; this allows 
- *          users to change what position they are writing/reading to/from.
- */
-static const struct file_operations  adc_fops = {
-	.owner = THIS_MODULE,
-	.read = adc_read,
-	.write = adc_write,
-	.llseek = default_llseek,
-};
-
 /**
- * XXX: both update and auto_update appear to be useless. The ADC *always*
- * auto updates regardless of what settings are used. Not that we can tell
- * what settings are used since the registers are read-only... :^| stupid!!!
- * Setting auto_update does set bit 15 high as a "refresh flag" as described
- * in the VHDL component's datasheet, but the values update every time you read
- * a channel register even when auto_update is off and bit 15 is low.
- * (╯°□°）╯︵ ┻━┻
- * Whatever... the adc channels update when we read, so that's all we want...
+ * adc_ch_delta_show() - Read a channel's delta-change threshold.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute we're reading from.
+ * @buf: Buffer that gets returned to user-space.
+ *
+ * Return: The number of bytes read.
  */
+static ssize_t adc_ch_delta_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct adc_dev *priv = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+	                 priv->event[adc_attr_channel(attr)].delta);
+}
+
 /**
- * update_store() - Start new ADC conversions.
- * 
- * Writing *any* value to the update register triggers an update.
- * 
- * @dev: Device structure for the adc component. This 
- *       device struct is embedded in the adc's platform 
- *       device struct.
- * @attr: Unused.
- * @buf: Buffer that contains the value being written.
+ * adc_ch_delta_store() - Set a channel's delta-change threshold.
+ * @dev: Device structure for the adc component.
+ * @attr: Which channel attribute is being written.
+ * @buf: Buffer that contains the change in LSB; 0 disables delta events.
  * @size: The number of bytes being written.
  *
- * Return: The number of bytes stored.
+ * Return: The number of bytes stored, or a negative error value.
  */
-static ssize_t update_store(struct device *dev,
+static ssize_t adc_ch_delta_store(struct device *dev,
 	struct device_attribute *attr, const char *buf, size_t size)
 {
 	struct adc_dev *priv = dev_get_drvdata(dev);
+	int ret;
 
-	/* 
-	 * Since writing any value to the update register triggers an update,
-	 * it doesn't matter what we write or what the user writes. So we ignore
-	 * what the user wants to write and just write a 1 :)
-	 */
-	iowrite32(1, priv->base_addr + UPDATE);
+	ret = adc_ch_event_store(dev, attr, buf,
+	                         &priv->event[adc_attr_channel(attr)].delta,
+	                         ADC_VALUE_BITMASK);
 
-	return 4;
+	return ret ? ret : size;
 }
 
 /**
- * auto_update_store() - Enable/disable auto-update
- * 
- * @dev: Device structure for the adc component. 
+ * max_staleness_us_store() - Set how old a cached snapshot readers accept.
+ * @dev: Device structure for the adc component.
  * @attr: Unused.
- * @buf: Buffer that contains the value being written.
+ * @buf: Buffer that contains the bound in microseconds; 0 disables the cache.
  * @size: The number of bytes being written.
  *
- * Return: The number of bytes stored.
+ * Return: The number of bytes stored, or a negative error value.
  */
-static ssize_t auto_update_store(struct device *dev,
+static ssize_t max_staleness_us_store(struct device *dev,
 	struct device_attribute *attr, const char *buf, size_t size)
 {
-
+	unsigned int us;
 	int ret;
 	struct adc_dev *priv = dev_get_drvdata(dev);
 
-	ret = kstrtobool(buf, &(priv->auto_update));
+	ret = kstrtouint(buf, 0, &us);
 	if (ret < 0) {
 		return ret;
 	}
+	if (us > ADC_MAX_STALENESS_US) {
+		return -EINVAL;
+	}
 
-	iowrite32(priv->auto_update, priv->base_addr + AUTO_UPDATE);
+	WRITE_ONCE(priv->max_staleness_ns, (u64)us * NSEC_PER_USEC);
 
 	return size;
 }
 
 /**
- * auto_update_show() - Read the auto_update setting.
- * @dev: Device structure for the adc component. 
+ * max_staleness_us_show() - Read the staleness bound of the cached snapshot.
+ * @dev: Device structure for the adc component.
  * @attr: Unused.
  * @buf: Buffer that gets returned to user-space.
  *
  * Return: The number of bytes read.
  */
-static ssize_t auto_update_show(struct device *dev,
+static ssize_t max_staleness_us_show(struct device *dev,
 	struct device_attribute *attr, char *buf)
 {
 	struct adc_dev *priv = dev_get_drvdata(dev);
 
-	/*
-	 * The auto_update register is actually a write-only register (dumb!), so
-	 * we return our shadow copy.
-	 */
-	return scnprintf(buf, PAGE_SIZE, "%u\n", priv->auto_update);
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+	                 div_u64(READ_ONCE(priv->max_staleness_ns), NSEC_PER_USEC));
 }
 
 /**
- * adc_ch_show() - Read ADC channel value.
- * 
- * @dev: Device structure for the adc component. 
- * @attr: Which adc channel attribute we're reading from.
+ * event_overruns_show() - Read the number of events dropped on a full queue.
+ * @dev: Device structure for the adc component.
+ * @attr: Unused.
  * @buf: Buffer that gets returned to user-space.
  *
  * Return: The number of bytes read.
  */
-static ssize_t adc_ch_show(struct device *dev,
+static ssize_t event_overruns_show(struct device *dev,
 	struct device_attribute *attr, char *buf)
 {
-	u16 adc_value;
 	struct adc_dev *priv = dev_get_drvdata(dev);
 
-	struct dev_ext_attribute *ch_attr = container_of(attr, 
-		struct dev_ext_attribute, attr);
-
-	u32 ch_offset = *(u32 *)(ch_attr->var);
-
-	adc_value = ioread32(priv->base_addr + ch_offset) & ADC_VALUE_BITMASK;
-
-	return scnprintf(buf, PAGE_SIZE, "%u\n", adc_value);
+	return scnprintf(buf, PAGE_SIZE, "%lu\n",
+	                 READ_ONCE(priv->event_overruns));
 }
 
 /*
@@ -295,12 +1734,56 @@ static ssize_t adc_ch_show(struct device *dev,
 	struct dev_ext_attribute dev_attr_##_name = \
 		{ __ATTR(_name, 0444, adc_ch_show, NULL), &(_reg_offset) }
 
+/*
+ * The per-channel conditioning attributes use the same trick as
+ * DEVICE_ADC_CH_ATTR: the channel's register offset rides along in the
+ * dev_ext_attribute, so one show/store pair serves all eight channels.
+ */
+#define DEVICE_ADC_CH_RW_ATTR(_name, _show, _store, _reg_offset) \
+	struct dev_ext_attribute dev_attr_##_name = \
+		{ __ATTR(_name, 0644, _show, _store), &(_reg_offset) }
+
+#define DEVICE_ADC_CH_FILTER_ATTRS(_ch) \
+	static DEVICE_ADC_CH_RW_ATTR(ch##_ch##_oversampling, \
+		adc_ch_oversampling_show, adc_ch_oversampling_store, CH##_ch); \
+	static DEVICE_ADC_CH_RW_ATTR(ch##_ch##_filter_shift, \
+		adc_ch_filter_shift_show, adc_ch_filter_shift_store, CH##_ch); \
+	static DEVICE_ADC_CH_RW_ATTR(ch##_ch##_decimation, \
+		adc_ch_decimation_show, adc_ch_decimation_store, CH##_ch)
+
+#define DEVICE_ADC_CH_EVENT_ATTRS(_ch) \
+	static DEVICE_ADC_CH_RW_ATTR(ch##_ch##_thresh_high, \
+		adc_ch_thresh_high_show, adc_ch_thresh_high_store, CH##_ch); \
+	static DEVICE_ADC_CH_RW_ATTR(ch##_ch##_thresh_low, \
+		adc_ch_thresh_low_show, adc_ch_thresh_low_store, CH##_ch); \
+	static DEVICE_ADC_CH_RW_ATTR(ch##_ch##_thresh_hyst, \
+		adc_ch_thresh_hyst_show, adc_ch_thresh_hyst_store, CH##_ch); \
+	static DEVICE_ADC_CH_RW_ATTR(ch##_ch##_delta, \
+		adc_ch_delta_show, adc_ch_delta_store, CH##_ch)
+
+#define ADC_CH_EVENT_ATTRS(_ch) \
+	&dev_attr_ch##_ch##_thresh_high.attr.attr, \
+	&dev_attr_ch##_ch##_thresh_low.attr.attr, \
+	&dev_attr_ch##_ch##_thresh_hyst.attr.attr, \
+	&dev_attr_ch##_ch##_delta.attr.attr
+
+#define ADC_CH_FILTER_ATTRS(_ch) \
+	&dev_attr_ch##_ch##_oversampling.attr.attr, \
+	&dev_attr_ch##_ch##_filter_shift.attr.attr, \
+	&dev_attr_ch##_ch##_decimation.attr.attr
+
 #define DEVICE_ULONG_ATTR_RO(_name, _var) \
 	struct dev_ext_attribute dev_attr_##_name = \
 		{ __ATTR(_name, 0444, device_show_ulong, NULL), &(_var) }
 
 static DEVICE_ATTR_WO(update);
 static DEVICE_ATTR_RW(auto_update);
+static DEVICE_ATTR_RW(sample_rate);
+static DEVICE_ATTR_RW(channel_mask);
+static DEVICE_ATTR_RW(watermark);
+static DEVICE_ATTR_RO(overruns);
+static DEVICE_ATTR_RO(event_overruns);
+static DEVICE_ATTR_RW(max_staleness_us);
 static DEVICE_ADC_CH_ATTR(ch0_raw, CH0);
 static DEVICE_ADC_CH_ATTR(ch1_raw, CH1);
 static DEVICE_ADC_CH_ATTR(ch2_raw, CH2);
@@ -310,10 +1793,32 @@ static DEVICE_ADC_CH_ATTR(ch5_raw, CH5);
 static DEVICE_ADC_CH_ATTR(ch6_raw, CH6);
 static DEVICE_ADC_CH_ATTR(ch7_raw, CH7);
 static DEVICE_ULONG_ATTR_RO(voltage_scale_mv, VOLTAGE_SCALE_MV);
+DEVICE_ADC_CH_FILTER_ATTRS(0);
+DEVICE_ADC_CH_FILTER_ATTRS(1);
+DEVICE_ADC_CH_FILTER_ATTRS(2);
+DEVICE_ADC_CH_FILTER_ATTRS(3);
+DEVICE_ADC_CH_FILTER_ATTRS(4);
+DEVICE_ADC_CH_FILTER_ATTRS(5);
+DEVICE_ADC_CH_FILTER_ATTRS(6);
+DEVICE_ADC_CH_FILTER_ATTRS(7);
+DEVICE_ADC_CH_EVENT_ATTRS(0);
+DEVICE_ADC_CH_EVENT_ATTRS(1);
+DEVICE_ADC_CH_EVENT_ATTRS(2);
+DEVICE_ADC_CH_EVENT_ATTRS(3);
+DEVICE_ADC_CH_EVENT_ATTRS(4);
+DEVICE_ADC_CH_EVENT_ATTRS(5);
+DEVICE_ADC_CH_EVENT_ATTRS(6);
+DEVICE_ADC_CH_EVENT_ATTRS(7);
 
 static struct attribute *adc_attrs[] = {
 	&dev_attr_update.attr,
 	&dev_attr_auto_update.attr,
+	&dev_attr_sample_rate.attr,
+	&dev_attr_channel_mask.attr,
+	&dev_attr_watermark.attr,
+	&dev_attr_overruns.attr,
+	&dev_attr_event_overruns.attr,
+	&dev_attr_max_staleness_us.attr,
 	&dev_attr_ch0_raw.attr.attr,
 	&dev_attr_ch1_raw.attr.attr,
 	&dev_attr_ch2_raw.attr.attr,
@@ -323,10 +1828,195 @@ static struct attribute *adc_attrs[] = {
 	&dev_attr_ch6_raw.attr.attr,
 	&dev_attr_ch7_raw.attr.attr,
 	&dev_attr_voltage_scale_mv.attr.attr,
+	ADC_CH_FILTER_ATTRS(0),
+	ADC_CH_FILTER_ATTRS(1),
+	ADC_CH_FILTER_ATTRS(2),
+	ADC_CH_FILTER_ATTRS(3),
+	ADC_CH_FILTER_ATTRS(4),
+	ADC_CH_FILTER_ATTRS(5),
+	ADC_CH_FILTER_ATTRS(6),
+	ADC_CH_FILTER_ATTRS(7),
+	ADC_CH_EVENT_ATTRS(0),
+	ADC_CH_EVENT_ATTRS(1),
+	ADC_CH_EVENT_ATTRS(2),
+	ADC_CH_EVENT_ATTRS(3),
+	ADC_CH_EVENT_ATTRS(4),
+	ADC_CH_EVENT_ATTRS(5),
+	ADC_CH_EVENT_ATTRS(6),
+	ADC_CH_EVENT_ATTRS(7),
 	NULL,
 };
 ATTRIBUTE_GROUPS(adc);
 
+/*
+ * IIO front end. Each channel register is exposed as an IIO voltage channel
+ * with a proper scale, and a triggered buffer lets standard consumers such as
+ * iio_readdev stream binary, timestamped scans. Any IIO trigger can drive the
+ * buffer; the usual choice is an iio-trig-hrtimer instance created through
+ * configfs.
+ */
+#define ADC_IIO_CHANNEL(_ch) {						\
+	.type = IIO_VOLTAGE,						\
+	.indexed = 1,							\
+	.channel = (_ch),						\
+	.address = (_ch) * 4,						\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),			\
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),		\
+	.scan_index = (_ch),						\
+	.scan_type = {							\
+		.sign = 'u',						\
+		.realbits = ADC_RESOLUTION_BITS,			\
+		.storagebits = 16,					\
+		.endianness = IIO_CPU,					\
+	},								\
+}
+
+static const struct iio_chan_spec adc_iio_channels[] = {
+	ADC_IIO_CHANNEL(0),
+	ADC_IIO_CHANNEL(1),
+	ADC_IIO_CHANNEL(2),
+	ADC_IIO_CHANNEL(3),
+	ADC_IIO_CHANNEL(4),
+	ADC_IIO_CHANNEL(5),
+	ADC_IIO_CHANNEL(6),
+	ADC_IIO_CHANNEL(7),
+	IIO_CHAN_SOFT_TIMESTAMP(ADC_NUM_CHANNELS),
+};
+
+/**
+ * adc_iio_read_raw() - Read a channel value or the shared scale.
+ * @indio_dev: The adc's IIO device.
+ * @chan: The channel being read.
+ * @val: First part of the returned value.
+ * @val2: Second part of the returned value.
+ * @mask: Which IIO_CHAN_INFO_* is being read.
+ *
+ * The scale is VREF / 2^12 mV per LSB, reported as IIO_VAL_FRACTIONAL_LOG2 so
+ * userspace gets it exactly.
+ *
+ * Return: The IIO_VAL_* format of the value, or a negative error value.
+ */
+static int adc_iio_read_raw(struct iio_dev *indio_dev,
+	struct iio_chan_spec const *chan, int *val, int *val2, long mask)
+{
+	struct adc_dev *priv = *(struct adc_dev **)iio_priv(indio_dev);
+	struct adc_cache cache;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		if (adc_cache_get(priv, BIT(chan->channel), &cache)) {
+			*val = cache.value[chan->channel];
+		} else {
+			*val = adc_channel_read(priv, chan->address);
+		}
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		*val = ADC_VREF_MV;
+		*val2 = ADC_RESOLUTION_BITS;
+		return IIO_VAL_FRACTIONAL_LOG2;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct iio_info adc_iio_info = {
+	.read_raw = adc_iio_read_raw,
+};
+
+/**
+ * adc_iio_trigger_handler() - Push one scan of the enabled channels.
+ * @irq: Unused.
+ * @p: The poll function of the triggered buffer.
+ *
+ * The timestamp is the one iio_pollfunc_store_time() captured when the
+ * trigger fired, not the time the registers happened to be read.
+ *
+ * Return: IRQ_HANDLED.
+ */
+static irqreturn_t adc_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct adc_dev *priv = *(struct adc_dev **)iio_priv(indio_dev);
+	struct {
+		u16 value[ADC_NUM_CHANNELS];
+		s64 timestamp __aligned(8);
+	} scan;
+	unsigned int ch;
+	unsigned int i = 0;
+
+	memset(&scan, 0, sizeof(scan));
+
+	for_each_set_bit(ch, indio_dev->active_scan_mask, ADC_NUM_CHANNELS) {
+		scan.value[i++] = adc_channel_read(priv, ch * 4);
+	}
+
+	iio_push_to_buffers_with_timestamp(indio_dev, &scan, pf->timestamp);
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+/**
+ * adc_iio_register() - Register the adc's IIO device.
+ * @pdev: The adc's platform device.
+ * @priv: The adc device.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int adc_iio_register(struct platform_device *pdev, struct adc_dev *priv)
+{
+	struct iio_dev *indio_dev;
+	int ret;
+
+	indio_dev = devm_iio_device_alloc(&pdev->dev, sizeof(priv));
+	if (!indio_dev) {
+		return -ENOMEM;
+	}
+	*(struct adc_dev **)iio_priv(indio_dev) = priv;
+
+	indio_dev->name = "de10nano_adc";
+	indio_dev->info = &adc_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = adc_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(adc_iio_channels);
+
+	ret = devm_iio_triggered_buffer_setup(&pdev->dev, indio_dev,
+	                                      iio_pollfunc_store_time,
+	                                      adc_iio_trigger_handler, NULL);
+	if (ret) {
+		return ret;
+	}
+
+	return devm_iio_device_register(&pdev->dev, indio_dev);
+}
+
+/**
+ * adc_sampler_cancel() - devm action that stops the sampler.
+ * @data: The adc device.
+ *
+ * Runs after the driver's sysfs attributes are gone, so nothing can restart
+ * the sampler afterwards.
+ */
+static void adc_sampler_cancel(void *data)
+{
+	struct adc_dev *priv = data;
+
+	hrtimer_cancel(&priv->sampler);
+}
+
+/**
+ * adc_ring_free() - devm action that frees the sample ring and event queue.
+ * @data: The adc device.
+ */
+static void adc_ring_free(void *data)
+{
+	struct adc_dev *priv = data;
+
+	kfifo_free(&priv->events);
+	kfifo_free(&priv->ring);
+}
+
 /**
  * adc_probe() - Initialize device when a match is found
  * @pdev: Platform device structure associated with our led patterns device;
@@ -340,7 +2030,9 @@ ATTRIBUTE_GROUPS(adc);
 static int adc_probe(struct platform_device *pdev)
 {
 	struct adc_dev *priv;
-	size_t ret;
+	struct resource *res;
+	unsigned int i;
+	int ret;
 
 	/*
 	 * Allocate kernel memory for the led patterns device and set it to 0.
@@ -355,17 +2047,66 @@ static int adc_probe(struct platform_device *pdev)
 		return -ENOMEM;
 	}
 
+	ret = fpga_stats_init(&pdev->dev, &priv->stats);
+	if (ret) {
+		pr_err("Failed to set up stats\n");
+		return ret;
+	}
+
 	/*
 	 * Request and remap the device's memory region. Requesting the region
 	 * make sure nobody else can use that memory. The memory is remapped
 	 * into the kernel's virtual address space because we don't have access
 	 * to physical memory locations.
 	 */
-	priv->base_addr = devm_platform_ioremap_resource(pdev, 0);
+	priv->base_addr = devm_platform_get_and_ioremap_resource(pdev, 0, &res);
 	if (IS_ERR(priv->base_addr)) {
 		pr_err("Failed to request/remap platform device resource\n");
 		return PTR_ERR(priv->base_addr);
 	}
+	priv->phys_addr = res->start;
+	priv->span = resource_size(res);
+
+	mutex_init(&priv->lock);
+	seqlock_init(&priv->cache_lock);
+	init_waitqueue_head(&priv->wait);
+
+	// Set up the sampler; it stays stopped until sample_rate is written.
+	priv->channel_mask = 0xff;
+	priv->watermark = ADC_DEFAULT_WATERMARK;
+	for (i = 0; i < ADC_NUM_CHANNELS; i++) {
+		priv->filter[i].decimation = 1;
+		priv->event[i].thresh_high = ADC_THRESH_HIGH_OFF;
+		priv->event[i].thresh_hyst = ADC_DEFAULT_THRESH_HYST;
+	}
+	ret = kfifo_alloc(&priv->ring, ADC_RING_SIZE, GFP_KERNEL);
+	if (ret) {
+		pr_err("Failed to allocate sample ring buffer\n");
+		return ret;
+	}
+	ret = kfifo_alloc(&priv->events, ADC_EVENT_QUEUE_SIZE, GFP_KERNEL);
+	if (ret) {
+		pr_err("Failed to allocate event queue\n");
+		kfifo_free(&priv->ring);
+		return ret;
+	}
+	ret = devm_add_action_or_reset(&pdev->dev, adc_ring_free, priv);
+	if (ret) {
+		return ret;
+	}
+
+	hrtimer_init(&priv->sampler, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	priv->sampler.function = adc_sampler_fn;
+	ret = devm_add_action_or_reset(&pdev->dev, adc_sampler_cancel, priv);
+	if (ret) {
+		return ret;
+	}
+
+	ret = adc_iio_register(pdev, priv);
+	if (ret) {
+		pr_err("Failed to register IIO device\n");
+		return ret;
+	}
 
 	// Initialize the misc device parameters
 	priv->miscdev.minor = MISC_DYNAMIC_MINOR;
@@ -386,6 +2127,9 @@ static int adc_probe(struct platform_device *pdev)
 	 */
 	platform_set_drvdata(pdev, priv);
 
+	// Publish the adc to in-kernel users of de10nano_adc_read().
+	rcu_assign_pointer(adc_api_dev, priv);
+
 	pr_info("adc_probe successful\n");
 
 	return 0;
@@ -403,6 +2147,10 @@ static int adc_remove(struct platform_device *pdev)
 	// Get the led patterns's private data from the platform device.
 	struct adc_dev *priv = platform_get_drvdata(pdev);
 
+	// Stop in-kernel readers before devm unmaps the registers.
+	RCU_INIT_POINTER(adc_api_dev, NULL);
+	synchronize_rcu();
+
 	// Deregister the misc device and remove the /dev/adc file.
 	misc_deregister(&priv->miscdev);
 
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0 or MIT */
+/*
+ * Userspace interface for the de10nano adc driver.
+ *
+ * This header is shared by the kernel module and by userspace programs that
+ * talk to /dev/adc, so it only uses the exported linux/ types.
+ */
+#ifndef _ADC_UAPI_H
+#define _ADC_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define ADC_NUM_CHANNELS 8
+
+/*
+ * Read modes for /dev/adc. The mode is stored per open file, so a logger can
+ * stream samples while another process keeps reading the channel registers.
+ *
+ * ADC_MODE_REGS:   read() returns channel registers addressed by the file
+ *                  offset (the original behavior, and the default).
+ * ADC_MODE_STREAM: read() drains whole struct adc_sample records produced by
+ *                  the driver's hrtimer sampler. Blocking reads and poll()
+ *                  wait until the ring buffer holds at least `watermark`
+ *                  samples (see the sysfs attributes).
+ * ADC_MODE_EVENTS: read() drains whole struct adc_event records raised by
+ *                  the sampler's threshold and delta checks. poll() only
+ *                  reports the file readable once an event has fired.
+ */
+#define ADC_MODE_REGS   0
+#define ADC_MODE_STREAM 1
+#define ADC_MODE_EVENTS 2
+
+/**
+ * struct adc_sample - One timestamped sample set from the sampler.
+ * @timestamp_ns: CLOCK_MONOTONIC time the sample set was taken.
+ * @value:        Channel values; only channels in @channel_mask are valid.
+ * @channel_mask: Bit n is set if @value[n] holds a new value.
+ * @seq:          Sample sequence number; gaps mean the ring overflowed.
+ */
+struct adc_sample {
+	__s64 timestamp_ns;
+	__u16 value[ADC_NUM_CHANNELS];
+	__u32 channel_mask;
+	__u32 seq;
+};
+
+/*
+ * Event types.
+ *
+ * ADC_EVENT_HIGH:  the value rose above the channel's chN_thresh_high.
+ * ADC_EVENT_LOW:   the value fell below the channel's chN_thresh_low.
+ * ADC_EVENT_DELTA: the value moved more than chN_delta LSB away from the
+ *                  value reported by the previous delta event.
+ *
+ * A threshold event fires once per crossing. It fires again only after the
+ * value has moved back by the channel's chN_thresh_hyst LSB (default 8):
+ * below chN_thresh_high - chN_thresh_hyst, or above chN_thresh_low +
+ * chN_thresh_hyst. A noisy channel sitting at a threshold therefore doesn't
+ * raise an event on every sample.
+ */
+#define ADC_EVENT_HIGH  0
+#define ADC_EVENT_LOW   1
+#define ADC_EVENT_DELTA 2
+
+/**
+ * struct adc_event - A threshold or delta event on one channel.
+ * @timestamp_ns: CLOCK_MONOTONIC time of the sample that tripped the event.
+ * @channel:      Channel that tripped.
+ * @type:         One of the ADC_EVENT_* types.
+ * @value:        Conditioned channel value that tripped the event.
+ * @reserved:     Always zero.
+ */
+struct adc_event {
+	__s64 timestamp_ns;
+	__u16 channel;
+	__u16 type;
+	__u16 value;
+	__u16 reserved;
+};
+
+/**
+ * struct adc_snapshot - Mutually consistent reading of several channels.
+ * @channel_mask: Set by the caller; bit n requests channel n.
+ * @reserved:     Must be zero.
+ * @timestamp_ns: CLOCK_MONOTONIC time the snapshot was taken.
+ * @value:        Channel values; channels not in @channel_mask read as 0.
+ */
+struct adc_snapshot {
+	__u32 channel_mask;
+	__u32 reserved;
+	__s64 timestamp_ns;
+	__u16 value[ADC_NUM_CHANNELS];
+};
+
+#define ADC_IOC_MAGIC 'a'
+
+/* Select the read mode of this open file; the argument is an ADC_MODE_* value */
+#define ADC_IOC_SET_MODE _IO(ADC_IOC_MAGIC, 0)
+
+/* Read the channels in channel_mask together, under one lock hold */
+#define ADC_IOC_SNAPSHOT _IOWR(ADC_IOC_MAGIC, 1, struct adc_snapshot)
+
+#endif /* _ADC_UAPI_H */
@@ -0,0 +1,320 @@
+/* SPDX-License-Identifier: GPL-2.0 or MIT */
+/*
+ * Latency and throughput instrumentation shared by the FPGA drivers.
+ *
+ * Each driver embeds a struct fpga_stats in its private device struct and
+ * routes its register accesses, lock acquisitions, and syscalls through the
+ * helpers below. Every operation type keeps a count, a total, a max-hold
+ * value, and a log2 histogram of its latency in nanoseconds, all in per-CPU
+ * storage so the fast paths never share a cache line.
+ *
+ * The results live in debugfs, under /sys/kernel/debug/<device name>/:
+ *
+ *   enable - write 1 to start timing, 0 to stop (off by default, so the
+ *            helpers cost one load and a branch when nobody is looking)
+ *   stats  - per-operation count, rate, mean, max, and histogram
+ *   reset  - write anything to zero all counters
+ *
+ * The drivers are built as separate modules, so everything here is static
+ * and each module gets its own copy.
+ */
+#ifndef _FPGA_STATS_H
+#define _FPGA_STATS_H
+
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+
+// Bucket n holds latencies in [2^(n-1), 2^n) ns; the last one catches the rest
+#define FPGA_STATS_BUCKETS 32
+
+enum fpga_stat_op {
+	FPGA_STAT_MMIO_READ,
+	FPGA_STAT_MMIO_WRITE,
+	FPGA_STAT_LOCK_WAIT,
+	FPGA_STAT_READ,
+	FPGA_STAT_WRITE,
+	FPGA_STAT_IOCTL,
+	FPGA_STAT_NR_OPS,
+};
+
+static const char * const fpga_stat_op_names[FPGA_STAT_NR_OPS] = {
+	[FPGA_STAT_MMIO_READ] = "mmio_read",
+	[FPGA_STAT_MMIO_WRITE] = "mmio_write",
+	[FPGA_STAT_LOCK_WAIT] = "lock_wait",
+	[FPGA_STAT_READ] = "read",
+	[FPGA_STAT_WRITE] = "write",
+	[FPGA_STAT_IOCTL] = "ioctl",
+};
+
+/**
+ * struct fpga_stat - Counters of one operation type on one CPU.
+ * @count:    Number of operations
+ * @total_ns: Sum of their latencies
+ * @max_ns:   Largest latency seen
+ * @hist:     log2 latency histogram
+ */
+struct fpga_stat {
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+	u64 hist[FPGA_STATS_BUCKETS];
+};
+
+/**
+ * struct fpga_stats - Instrumentation state of one device.
+ * @ops:      Per-CPU array of FPGA_STAT_NR_OPS counters
+ * @enabled:  Timing is on; toggled through debugfs
+ * @reset_ns: Time of the last reset, used to turn counts into rates
+ * @dir:      The device's debugfs directory
+ */
+struct fpga_stats {
+	struct fpga_stat __percpu *ops;
+	bool enabled;
+	u64 reset_ns;
+	struct dentry *dir;
+};
+
+/**
+ * fpga_stats_start() - Take the start time of an operation.
+ * @stats: The device's stats.
+ *
+ * Return: The start time, or 0 if timing is disabled.
+ */
+static inline u64 fpga_stats_start(struct fpga_stats *stats)
+{
+	if (!READ_ONCE(stats->enabled)) {
+		return 0;
+	}
+
+	return ktime_get_ns();
+}
+
+/**
+ * fpga_stats_end() - Account a finished operation.
+ * @stats: The device's stats.
+ * @op: The operation type.
+ * @start: Value returned by fpga_stats_start().
+ *
+ * Safe from any context. The this_cpu operations are each irq-safe; the
+ * max-hold update is not atomic as a whole, so a softirq landing between the
+ * compare and the store can lose a concurrent max. That is fine for
+ * diagnostics and keeps the fast path free of locks.
+ */
+static inline void fpga_stats_end(struct fpga_stats *stats,
+	enum fpga_stat_op op, u64 start)
+{
+	u64 ns;
+	unsigned int bucket;
+
+	if (!start) {
+		return;
+	}
+
+	ns = ktime_get_ns() - start;
+	bucket = min_t(unsigned int, fls64(ns), FPGA_STATS_BUCKETS - 1);
+
+	this_cpu_inc(stats->ops[op].count);
+	this_cpu_add(stats->ops[op].total_ns, ns);
+	this_cpu_inc(stats->ops[op].hist[bucket]);
+	if (ns > this_cpu_read(stats->ops[op].max_ns)) {
+		this_cpu_write(stats->ops[op].max_ns, ns);
+	}
+}
+
+/**
+ * fpga_stats_ioread32() - ioread32() that accounts the bus access.
+ * @stats: The device's stats.
+ * @addr: Register address.
+ *
+ * Return: The register value.
+ */
+static inline u32 fpga_stats_ioread32(struct fpga_stats *stats,
+	void __iomem *addr)
+{
+	u64 start = fpga_stats_start(stats);
+	u32 val = ioread32(addr);
+
+	fpga_stats_end(stats, FPGA_STAT_MMIO_READ, start);
+	return val;
+}
+
+/**
+ * fpga_stats_iowrite32() - iowrite32() that accounts the bus access.
+ * @stats: The device's stats.
+ * @val: Value to write.
+ * @addr: Register address.
+ */
+static inline void fpga_stats_iowrite32(struct fpga_stats *stats, u32 val,
+	void __iomem *addr)
+{
+	u64 start = fpga_stats_start(stats);
+
+	iowrite32(val, addr);
+	fpga_stats_end(stats, FPGA_STAT_MMIO_WRITE, start);
+}
+
+/**
+ * fpga_stats_mutex_lock() - mutex_lock() that accounts the time spent waiting.
+ * @stats: The device's stats.
+ * @lock: The mutex to take.
+ */
+static inline void fpga_stats_mutex_lock(struct fpga_stats *stats,
+	struct mutex *lock)
+{
+	u64 start = fpga_stats_start(stats);
+
+	mutex_lock(lock);
+	fpga_stats_end(stats, FPGA_STAT_LOCK_WAIT, start);
+}
+
+/**
+ * fpga_stats_spin_lock_bh() - spin_lock_bh() that accounts the time spinning.
+ * @stats: The device's stats.
+ * @lock: The spinlock to take.
+ */
+static inline void fpga_stats_spin_lock_bh(struct fpga_stats *stats,
+	spinlock_t *lock)
+{
+	u64 start = fpga_stats_start(stats);
+
+	spin_lock_bh(lock);
+	fpga_stats_end(stats, FPGA_STAT_LOCK_WAIT, start);
+}
+
+/**
+ * fpga_stats_reset() - Zero the counters of every CPU.
+ * @stats: The device's stats.
+ *
+ * Operations in flight on other CPUs may land in either epoch.
+ */
+static inline void fpga_stats_reset(struct fpga_stats *stats)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(stats->ops, cpu), 0,
+		       FPGA_STAT_NR_OPS * sizeof(struct fpga_stat));
+	}
+	WRITE_ONCE(stats->reset_ns, ktime_get_ns());
+}
+
+/**
+ * fpga_stats_show() - Print the summed counters of every operation type.
+ * @s: The debugfs "stats" file.
+ * @unused: Unused.
+ *
+ * Return: 0.
+ */
+static inline int fpga_stats_show(struct seq_file *s, void *unused)
+{
+	struct fpga_stats *stats = s->private;
+	struct fpga_stat sum;
+	const struct fpga_stat *c;
+	u64 elapsed_ns = ktime_get_ns() - READ_ONCE(stats->reset_ns);
+	unsigned int op, b;
+	int cpu;
+
+	seq_printf(s, "enabled: %d, window: %llu ms\n",
+	           READ_ONCE(stats->enabled), div_u64(elapsed_ns, NSEC_PER_MSEC));
+
+	for (op = 0; op < FPGA_STAT_NR_OPS; op++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			c = per_cpu_ptr(&stats->ops[op], cpu);
+			sum.count += c->count;
+			sum.total_ns += c->total_ns;
+			sum.max_ns = max(sum.max_ns, c->max_ns);
+			for (b = 0; b < FPGA_STATS_BUCKETS; b++) {
+				sum.hist[b] += c->hist[b];
+			}
+		}
+
+		seq_printf(s, "\n%s: count %llu, %llu/s, mean %llu ns, max %llu ns\n",
+		           fpga_stat_op_names[op], sum.count,
+		           elapsed_ns ? div64_u64(sum.count * NSEC_PER_SEC, elapsed_ns) : 0,
+		           sum.count ? div64_u64(sum.total_ns, sum.count) : 0,
+		           sum.max_ns);
+		for (b = 0; b < FPGA_STATS_BUCKETS; b++) {
+			if (sum.hist[b]) {
+				seq_printf(s, "  < 2^%-2u ns: %llu\n", b, sum.hist[b]);
+			}
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fpga_stats);
+
+/**
+ * fpga_stats_reset_write() - Write method of the debugfs "reset" file.
+ * @file: The "reset" file.
+ * @buf: Ignored.
+ * @count: The number of bytes being written.
+ * @offset: Ignored.
+ *
+ * Return: @count.
+ */
+static inline ssize_t fpga_stats_reset_write(struct file *file,
+	const char __user *buf, size_t count, loff_t *offset)
+{
+	fpga_stats_reset(file->private_data);
+	return count;
+}
+
+static const struct file_operations fpga_stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = fpga_stats_reset_write,
+	.llseek = noop_llseek,
+};
+
+/**
+ * fpga_stats_release() - devm action that tears the stats down.
+ * @data: The device's stats.
+ */
+static inline void fpga_stats_release(void *data)
+{
+	struct fpga_stats *stats = data;
+
+	debugfs_remove_recursive(stats->dir);
+	free_percpu(stats->ops);
+}
+
+/**
+ * fpga_stats_init() - Allocate a device's counters and create its debugfs files.
+ * @dev: The device; its name names the debugfs directory.
+ * @stats: The stats embedded in the driver's private struct.
+ *
+ * Everything is released by devm when the device goes away. Call this before
+ * anything that uses the helpers above can run, e.g. before misc_register().
+ * A missing debugfs is not an error; the counters still work.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static inline int fpga_stats_init(struct device *dev, struct fpga_stats *stats)
+{
+	stats->ops = (struct fpga_stat __percpu *)
+		__alloc_percpu(FPGA_STAT_NR_OPS * sizeof(struct fpga_stat),
+		               __alignof__(struct fpga_stat));
+	if (!stats->ops) {
+		return -ENOMEM;
+	}
+	stats->reset_ns = ktime_get_ns();
+
+	stats->dir = debugfs_create_dir(dev_name(dev), NULL);
+	debugfs_create_bool("enable", 0600, stats->dir, &stats->enabled);
+	debugfs_create_file("stats", 0400, stats->dir, stats, &fpga_stats_fops);
+	debugfs_create_file("reset", 0200, stats->dir, stats,
+	                    &fpga_stats_reset_fops);
+
+	return devm_add_action_or_reset(dev, fpga_stats_release, stats);
+}
+
+#endif /* _FPGA_STATS_H */
@@ -13,11 +13,52 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/kstrtox.h>
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/input.h>
+#include <linux/input/sparse-keymap.h>
+#include <linux/bitfield.h>
 
+#include "../fpga_stats.h"
+#include "kb_uapi.h"
 
 
+
+#define KB_BUFFER_OFFSET 0x0
+#define IRQ_STATUS_OFFSET 0x4
+#define CTRL_OFFSET 0x8
+#define FIFO_DATA_OFFSET 0xC
+
 #define BYTE_SIZE 16
 
+#define IRQ_NEW_CODE 0x1	// irq_status/ctrl bit: the row sweep latched a new code
+#define IRQ_OVERFLOW 0x2	// irq_status/ctrl bit: the hardware FIFO dropped a code
+
+#define CTRL_IRQ_ENABLE GENMASK(1, 0)		// Interrupt enables, one per irq_status bit
+#define CTRL_DEBOUNCE BIT(7)				// Scan the debounced columns
+#define CTRL_DEBOUNCE_MS GENMASK(15, 8)		// Debouncer lockout in ms, read-only
+#define CTRL_SCAN_PERIOD GENMASK(31, 16)	// Time per row step in us
+
+#define SCAN_PERIOD_MIN_US 100		// The hardware clamps shorter periods to this
+#define SCAN_PERIOD_MAX_US 65535
+
+#define FIFO_VALID BIT(31)				// fifo_data holds an event
+#define FIFO_PRESENT BIT(30)			// Always set by bitstreams that have the FIFO
+#define FIFO_LEVEL GENMASK(20, 16)		// Events in the FIFO, including this one
+#define FIFO_CODE GENMASK(8, 0)			// kb_buffer value of the event
+
+#define KB_CODE_MASK 0xFF	// kb_buffer bits that hold the key code
+#define KB_PRESSED 0x100	// kb_buffer bit that is set while the key is down
+#define KB_SCANCODE(code) (KB_PRESSED | ((code) & KB_CODE_MASK))	// kb_buffer value of a held key
+
+#define EVENT_QUEUE_SIZE 256	// Queued key events; must be a power of two for kfifo
+#define POLL_INTERVAL_US 5000	// kb_buffer polling interval without an interrupt
+
 
 /**
  * Define the compatible property used for matching devices to this driver,
@@ -31,12 +72,62 @@ static const struct of_device_id keyboard_of_match[] =
 	{}
 };
 
+/**
+ * Translation of the scan codes latched by the row sweep in keyboard.vhd
+ * into input event codes. Digits are unambiguous; the function keys follow
+ * their position on the calculator keypad. Userspace can remap any of them
+ * with EVIOCSKEYCODE.
+ */
+static const struct key_entry keyboard_keymap[] =
+{
+	{ KE_KEY, KB_SCANCODE(0x40), { KEY_KP0 } },
+	{ KE_KEY, KB_SCANCODE(0x41), { KEY_KP1 } },
+	{ KE_KEY, KB_SCANCODE(0x42), { KEY_KP2 } },
+	{ KE_KEY, KB_SCANCODE(0x43), { KEY_KP3 } },
+	{ KE_KEY, KB_SCANCODE(0x44), { KEY_KP4 } },
+	{ KE_KEY, KB_SCANCODE(0x45), { KEY_KP5 } },
+	{ KE_KEY, KB_SCANCODE(0x46), { KEY_KP6 } },
+	{ KE_KEY, KB_SCANCODE(0x47), { KEY_KP7 } },
+	{ KE_KEY, KB_SCANCODE(0x48), { KEY_KP8 } },
+	{ KE_KEY, KB_SCANCODE(0x49), { KEY_KP9 } },
+	{ KE_KEY, KB_SCANCODE(0x10), { KEY_KPPLUS } },
+	{ KE_KEY, KB_SCANCODE(0x11), { KEY_KPMINUS } },
+	{ KE_KEY, KB_SCANCODE(0x12), { KEY_KPASTERISK } },
+	{ KE_KEY, KB_SCANCODE(0x13), { KEY_KPSLASH } },
+	{ KE_KEY, KB_SCANCODE(0x20), { KEY_KPDOT } },
+	{ KE_KEY, KB_SCANCODE(0x21), { KEY_KPENTER } },
+	{ KE_KEY, KB_SCANCODE(0x30), { KEY_BACKSPACE } },
+	{ KE_KEY, KB_SCANCODE(0x31), { KEY_DELETE } },
+	{ KE_KEY, KB_SCANCODE(0x32), { KEY_ESC } },
+	{ KE_END, 0 },
+};
+
 /**
  * struct keyboard_dev - Private keyboard device struct.
  * @base_addr:        Pointer to the component's base address
  * @kb_buffer:        Address of the control register
+ * @irq_status:       Address of the interrupt status register (write 1 to clear)
+ * @ctrl:             Address of the control register: interrupt enables,
+ *                    debounce enable, and scan period
+ * @fifo_data:        Address of the event FIFO register; reading it pops
+ * @phys_addr:        Physical base address of the register window
+ * @span:             Size of the register window in bytes
  * @miscdev:          miscdevice used to create a character device
  * @lock:             mutex used to prevent concurrent writes to memory
+ * @stats:            Latency and throughput counters, exposed in debugfs
+ * @irq:              Interrupt number, or negative if the device tree node
+ *                    has none and @poll_timer watches kb_buffer instead
+ * @poll_timer:       hrtimer that polls kb_buffer when there is no interrupt
+ * @has_fifo:         The bitstream queues events in a hardware FIFO
+ * @has_scan_ctrl:    The bitstream has the scan period and debounce controls
+ * @drain_lock:       spinlock that serializes the poll timer and readers
+ *                    draining the hardware FIFO when there is no interrupt
+ * @events:           Lock-free queue of key events; the interrupt handler or
+ *                    @poll_timer produces, readers serialize on @lock
+ * @last:             kb_buffer value of the last queued event
+ * @overruns:         Number of events dropped because @events was full
+ * @wait:             Wait queue of readers and poll()
+ * @input:            Input device that reports the keys to evdev
  *
  * keyboard_dev struct gets created for each keyboard component.
  */
@@ -44,46 +135,536 @@ struct keyboard_dev
 {
 	void __iomem *base_addr;
 	void __iomem *kb_buffer;
+	void __iomem *irq_status;
+	void __iomem *ctrl;
+	void __iomem *fifo_data;
+	phys_addr_t phys_addr;
+	resource_size_t span;
 	struct miscdevice miscdev;
 	struct mutex lock;
+	struct fpga_stats stats;
+	int irq;
+	struct hrtimer poll_timer;
+	bool has_fifo;
+	bool has_scan_ctrl;
+	spinlock_t drain_lock;
+	DECLARE_KFIFO_PTR(events, struct kb_event);
+	u32 last;
+	unsigned long overruns;
+	wait_queue_head_t wait;
+	struct input_dev *input;
 };
 
 
 
+// KEY EVENTS -----------------------------------------------------------------
+
+/**
+ * keyboard_report() - Queue one key event and report it to the input device.
+ * @priv:    The keyboard device.
+ * @now:     Timestamp of the event.
+ * @code:    The key code, without KB_PRESSED.
+ * @pressed: Whether the key went down or up.
+ */
+static void keyboard_report(struct keyboard_dev *priv, ktime_t now, u32 code, bool pressed)
+{
+	struct kb_event event =
+	{
+		.timestamp_ns = ktime_to_ns(now),
+		.code = code,
+		.pressed = pressed,
+	};
+	
+	if (!kfifo_put(&priv->events, event))
+	{
+		priv->overruns++;
+	}
+	
+	input_set_timestamp(priv->input, now);
+	sparse_keymap_report_event(priv->input, KB_SCANCODE(code), pressed, false);
+}
+
+/**
+ * keyboard_push_event() - Queue a kb_buffer change as a key event.
+ * @priv: The keyboard device.
+ * @code: The new kb_buffer value.
+ *
+ * Called by the single producer, the interrupt handler or the poll timer.
+ * The event also goes to the input device, with the same timestamp; the
+ * input core takes care of auto-repeat.
+ *
+ * The row sweep can go straight from one held key to another when a finger
+ * rolls across a row, without a release in between. The held key is then
+ * released first, so neither the event queue nor the input core keeps it
+ * down.
+ */
+static void keyboard_push_event(struct keyboard_dev *priv, u32 code)
+{
+	ktime_t now = ktime_get();
+	
+	if ((priv->last & KB_PRESSED) && (code & KB_PRESSED)
+		&& (priv->last & KB_CODE_MASK) != (code & KB_CODE_MASK))
+	{
+		keyboard_report(priv, now, priv->last & KB_CODE_MASK, false);
+	}
+	keyboard_report(priv, now, code & KB_CODE_MASK, code & KB_PRESSED);
+	
+	priv->last = code;
+	wake_up_interruptible(&priv->wait);
+}
+
+/**
+ * keyboard_input_register() - Register the keypad as an input device.
+ * @priv: The keyboard device.
+ * @dev:  The platform device's struct device.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int keyboard_input_register(struct keyboard_dev *priv, struct device *dev)
+{
+	int ret;
+	
+	priv->input = devm_input_allocate_device(dev);
+	if (!priv->input)
+	{
+		return -ENOMEM;
+	}
+	
+	priv->input->name = "DE10-Nano calculator keypad";
+	priv->input->phys = "keyboard/input0";
+	priv->input->id.bustype = BUS_HOST;
+	
+	ret = sparse_keymap_setup(priv->input, keyboard_keymap, NULL);
+	if (ret)
+	{
+		return ret;
+	}
+	__set_bit(EV_REP, priv->input->evbit);
+	
+	return input_register_device(priv->input);
+}
+
+/**
+ * keyboard_drain() - Move every event from the hardware FIFO into the queue.
+ * @priv: The keyboard device; the caller is the single producer.
+ *
+ * Each pop also reports how many events were left, so draining N events
+ * takes N bus reads and no extra status read.
+ */
+static void keyboard_drain(struct keyboard_dev *priv)
+{
+	u32 word;
+	
+	do
+	{
+		word = fpga_stats_ioread32(&priv->stats, priv->fifo_data);
+		if (!(word & FIFO_VALID))
+		{
+			break;
+		}
+		keyboard_push_event(priv, FIELD_GET(FIFO_CODE, word));
+	}
+	while (FIELD_GET(FIFO_LEVEL, word) > 1);
+}
+
+/**
+ * keyboard_irq() - Interrupt handler of the keyboard.
+ * @irq:  Unused.
+ * @data: The keyboard device.
+ *
+ * Acknowledges the interrupt before draining the FIFO, or reading kb_buffer
+ * on bitstreams without one, so a code latched in between raises the
+ * interrupt again instead of getting lost.
+ *
+ * Return: IRQ_HANDLED, or IRQ_NONE if the keyboard didn't raise it.
+ */
+static irqreturn_t keyboard_irq(int irq, void *data)
+{
+	struct keyboard_dev *priv = data;
+	u32 status;
+	
+	status = fpga_stats_ioread32(&priv->stats, priv->irq_status);
+	if (!(status & (IRQ_NEW_CODE | IRQ_OVERFLOW)))
+	{
+		return IRQ_NONE;
+	}
+	fpga_stats_iowrite32(&priv->stats, status, priv->irq_status);
+	
+	if (status & IRQ_OVERFLOW)
+	{
+		priv->overruns++;
+	}
+	if (priv->has_fifo)
+	{
+		keyboard_drain(priv);
+	}
+	else
+	{
+		keyboard_push_event(priv, fpga_stats_ioread32(&priv->stats, priv->kb_buffer));
+	}
+	
+	return IRQ_HANDLED;
+}
+
+/**
+ * keyboard_poll_fn() - Queue an event when kb_buffer changed since the last.
+ * @timer: The keyboard's poll timer.
+ *
+ * Runs in softirq context every POLL_INTERVAL_US when there is no interrupt.
+ * With the hardware FIFO, it drains the FIFO. Without it, it compares
+ * kb_buffer with the last event; the row sweep holds a code for at least
+ * one 21 ms step, so no key press is missed at this interval.
+ *
+ * Return: HRTIMER_RESTART.
+ */
+static enum hrtimer_restart keyboard_poll_fn(struct hrtimer *timer)
+{
+	struct keyboard_dev *priv = container_of(timer, struct keyboard_dev, poll_timer);
+	u32 code;
+	
+	if (priv->has_fifo)
+	{
+		spin_lock(&priv->drain_lock);
+		keyboard_drain(priv);
+		spin_unlock(&priv->drain_lock);
+	}
+	else
+	{
+		code = fpga_stats_ioread32(&priv->stats, priv->kb_buffer);
+		if (code != priv->last)
+		{
+			keyboard_push_event(priv, code);
+		}
+	}
+	
+	hrtimer_forward_now(timer, us_to_ktime(POLL_INTERVAL_US));
+	return HRTIMER_RESTART;
+}
+
+/**
+ * keyboard_events_release() - devm action that stops the poll timer and frees
+ * the event queue.
+ * @data: The keyboard device.
+ */
+static void keyboard_events_release(void *data)
+{
+	struct keyboard_dev *priv = data;
+	
+	hrtimer_cancel(&priv->poll_timer);
+	kfifo_free(&priv->events);
+}
+
+// END OF KEY EVENTS -----------------------------------------------------------
+
+
+
+// ATTRIBUTES -----------------------------------------------------------------
+
+/**
+ * keyboard_ctrl_update() - Change some fields of the control register.
+ * @priv: The keyboard device.
+ * @mask: The bits to change.
+ * @val:  Their new value.
+ *
+ * The interrupt enables and the scan controls share the register, so every
+ * write is a read-modify-write under @priv->lock. On bitstreams with the
+ * scan controls, the new value is checked under the same lock: while
+ * debouncing is enabled, the scan period must be longer than the debouncer
+ * lockout, or a column still locked from the previous row would be scanned.
+ *
+ * Return: 0 on success, or -EINVAL if the new value breaks that rule; the
+ *         register is then left unchanged.
+ */
+static int keyboard_ctrl_update(struct keyboard_dev *priv, u32 mask, u32 val)
+{
+	u32 ctrl;
+	int ret = 0;
+	
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	ctrl = fpga_stats_ioread32(&priv->stats, priv->ctrl);
+	ctrl = (ctrl & ~mask) | (val & mask);
+	if (priv->has_scan_ctrl && (ctrl & CTRL_DEBOUNCE)
+		&& FIELD_GET(CTRL_SCAN_PERIOD, ctrl) <= FIELD_GET(CTRL_DEBOUNCE_MS, ctrl) * USEC_PER_MSEC)
+	{
+		ret = -EINVAL;
+	}
+	else
+	{
+		fpga_stats_iowrite32(&priv->stats, ctrl, priv->ctrl);
+	}
+	mutex_unlock(&priv->lock);
+	
+	return ret;
+}
+
+
+
+/**
+ * scan_period_us_show() - Return the time the row sweep spends on each row.
+ * @dev:  Device structure for the keyboard component. This is embedded
+ *        in the keyboard's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t scan_period_us_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct keyboard_dev *priv = dev_get_drvdata(dev);
+	
+	if (!priv->has_scan_ctrl)
+	{
+		return -EOPNOTSUPP;
+	}
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", FIELD_GET(CTRL_SCAN_PERIOD, ioread32(priv->ctrl)));
+}
+
+/**
+ * scan_period_us_store() - Set the time the row sweep spends on each row.
+ * @dev:  Device structure for the keyboard component. This is embedded
+ *        in the keyboard's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that contains the period in microseconds.
+ * @size: The number of bytes being written.
+ *
+ * A full sweep of the three rows takes three periods. While debouncing is
+ * enabled, the period must be longer than the debouncer lockout, or a
+ * column still locked from the previous row would be scanned.
+ * 
+ * Return: The number of bytes stored.
+ */
+static ssize_t scan_period_us_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct keyboard_dev *priv = dev_get_drvdata(dev);
+	unsigned int period;
+	int ret;
+	
+	if (!priv->has_scan_ctrl)
+	{
+		return -EOPNOTSUPP;
+	}
+	
+	ret = kstrtouint(buf, 0, &period);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	if (period < SCAN_PERIOD_MIN_US || period > SCAN_PERIOD_MAX_US)
+	{
+		return -EINVAL;
+	}
+	
+	ret = keyboard_ctrl_update(priv, CTRL_SCAN_PERIOD, FIELD_PREP(CTRL_SCAN_PERIOD, period));
+	
+	return ret ? ret : size;
+}
+
+
+
+/**
+ * debounce_show() - Return whether the row sweep scans debounced columns.
+ * @dev:  Device structure for the keyboard component. This is embedded
+ *        in the keyboard's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t debounce_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct keyboard_dev *priv = dev_get_drvdata(dev);
+	
+	if (!priv->has_scan_ctrl)
+	{
+		return -EOPNOTSUPP;
+	}
+	
+	return scnprintf(buf, PAGE_SIZE, "%d\n", !!(ioread32(priv->ctrl) & CTRL_DEBOUNCE));
+}
+
+/**
+ * debounce_store() - Turn the column debouncers on or off.
+ * @dev:  Device structure for the keyboard component. This is embedded
+ *        in the keyboard's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that contains a boolean.
+ * @size: The number of bytes being written.
+ *
+ * With debouncing off, the row sweep scans the synchronized columns as they
+ * are. Debouncing can only be turned on while the scan period is longer than
+ * the debouncer lockout.
+ * 
+ * Return: The number of bytes stored.
+ */
+static ssize_t debounce_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct keyboard_dev *priv = dev_get_drvdata(dev);
+	bool enable;
+	int ret;
+	
+	if (!priv->has_scan_ctrl)
+	{
+		return -EOPNOTSUPP;
+	}
+	
+	ret = kstrtobool(buf, &enable);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	
+	ret = keyboard_ctrl_update(priv, CTRL_DEBOUNCE, enable ? CTRL_DEBOUNCE : 0);
+	
+	return ret ? ret : size;
+}
+
+
+
+/**
+ * debounce_ms_show() - Return the debouncer lockout built into the bitstream.
+ * @dev:  Device structure for the keyboard component. This is embedded
+ *        in the keyboard's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t debounce_ms_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct keyboard_dev *priv = dev_get_drvdata(dev);
+	
+	if (!priv->has_scan_ctrl)
+	{
+		return -EOPNOTSUPP;
+	}
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", FIELD_GET(CTRL_DEBOUNCE_MS, ioread32(priv->ctrl)));
+}
+
+
+
+/**
+ * overruns_show() - Return the number of key events dropped on a full queue.
+ * @dev:  Device structure for the keyboard component. This is embedded
+ *        in the keyboard's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t overruns_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct keyboard_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(priv->overruns));
+}
+
+
+
+// Define sysfs attributes
+static DEVICE_ATTR_RO(overruns);
+static DEVICE_ATTR_RW(scan_period_us);
+static DEVICE_ATTR_RW(debounce);
+static DEVICE_ATTR_RO(debounce_ms);
+
+// Create an attribute group so the device core can export attributes for us
+static struct attribute *keyboard_attrs[] =
+{
+	&dev_attr_overruns.attr,
+	&dev_attr_scan_period_us.attr,
+	&dev_attr_debounce.attr,
+	&dev_attr_debounce_ms.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(keyboard);
+
+// END OF ATTRIBUTES ----------------------------------------------------------
+
+
+
 // FILE OPERATIONS ------------------------------------------------------------
 
 /**
- * keyboard_read() - Read method for the keyboard char device
+ * keyboard_do_read() - Read method for the keyboard char device
  * @file:   Pointer to the char device file struct.
- * @buf:    User-space buffer to read the value into.
+ * @buf:    User-space buffer to read the events into.
  * @count:  The number of bytes being requested.
- * @offset: The byte offset in the file being read from.
+ * @offset: Unused; the device is a stream.
  *
- * Return: On success, the number of bytes written is returned and the
- * offset @offset is advanced by this number. On error, a negative error
- * value is returned.
+ * Returns as many whole struct kb_event records as are queued and fit in
+ * @count. Blocks until the first event arrives unless the file is
+ * O_NONBLOCK. Without an interrupt, the hardware FIFO is drained first, so
+ * events don't wait for the next poll tick.
+ *
+ * Return: On success, the number of bytes read is returned. On error, a
+ * negative error value is returned.
  */
-static ssize_t keyboard_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+static ssize_t keyboard_do_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
 {
-	unsigned int button;
 	struct keyboard_dev *priv = container_of(file->private_data, struct keyboard_dev, miscdev);
-	size_t bytes_copied = 0;
+	unsigned int copied = 0;
+	int ret;
 	
-	if (*offset != 0)
+	if (count < sizeof(struct kb_event))
 	{
-		*offset = 0;
+		return -EINVAL;
 	}
 	
-	button = ioread32(priv->kb_buffer);
+	if (priv->irq <= 0 && priv->has_fifo)
+	{
+		spin_lock_bh(&priv->drain_lock);
+		keyboard_drain(priv);
+		spin_unlock_bh(&priv->drain_lock);
+	}
 	
-	bytes_copied = 1 - copy_to_user(buf, &button, 4);
-	if (bytes_copied == 0)
+	// Another reader may drain the queue between the wakeup and the lock.
+	while (copied == 0)
 	{
-		pr_warn("keyboard_read: Zero bytes copied to userspace.\n");
-		return -EFAULT;
+		if (kfifo_is_empty(&priv->events))
+		{
+			if (file->f_flags & O_NONBLOCK)
+			{
+				return -EAGAIN;
+			}
+			ret = wait_event_interruptible(priv->wait, !kfifo_is_empty(&priv->events));
+			if (ret)
+			{
+				return ret;
+			}
+		}
+		
+		fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+		ret = kfifo_to_user(&priv->events, buf, count, &copied);
+		mutex_unlock(&priv->lock);
+		if (ret)
+		{
+			return ret;
+		}
 	}
 	
-	return bytes_copied;
+	return copied;
+}
+
+
+
+/*
+ * The read entry point times the whole syscall into the device's stats.
+ */
+static ssize_t keyboard_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+{
+	struct keyboard_dev *priv = container_of(file->private_data, struct keyboard_dev, miscdev);
+	u64 start = fpga_stats_start(&priv->stats);
+	ssize_t ret = keyboard_do_read(file, buf, count, offset);
+	
+	fpga_stats_end(&priv->stats, FPGA_STAT_READ, start);
+	return ret;
 }
 
 
@@ -107,6 +688,56 @@ static ssize_t keyboard_write(struct file *file, const char __user *buf, size_t
 
 
 
+/**
+ * keyboard_poll() - Poll method for the keyboard char device
+ * @file: Pointer to the char device file struct.
+ * @wait: Poll table to register the wait queue with.
+ *
+ * Return: EPOLLIN | EPOLLRDNORM while key events are queued, otherwise 0.
+ */
+static __poll_t keyboard_poll(struct file *file, poll_table *wait)
+{
+	struct keyboard_dev *priv = container_of(file->private_data, struct keyboard_dev, miscdev);
+	
+	poll_wait(file, &priv->wait, wait);
+	return kfifo_is_empty(&priv->events) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+
+
+/**
+ * keyboard_mmap() - Mmap method for the keyboard char device
+ * @file: Pointer to the char device file struct.
+ * @vma:  Userspace mapping being set up.
+ *
+ * Maps the keyboard register window into userspace, uncached. Only a
+ * window that starts on a page boundary and owns all of its pages can be
+ * mapped; a smaller window shares its page with other components, so the
+ * request fails with -EINVAL and events have to be read with read().
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int keyboard_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct keyboard_dev *priv = container_of(file->private_data, struct keyboard_dev, miscdev);
+	unsigned long pages = priv->span >> PAGE_SHIFT;
+	
+	if (!(vma->vm_flags & VM_SHARED) || !PAGE_ALIGNED(priv->phys_addr) ||
+		!PAGE_ALIGNED(priv->span))
+	{
+		return -EINVAL;
+	}
+	if (vma->vm_pgoff >= pages || vma_pages(vma) > pages - vma->vm_pgoff)
+	{
+		return -EINVAL;
+	}
+	
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	return vm_iomap_memory(vma, priv->phys_addr, priv->span);
+}
+
+
+
 /**
  * keyboard_fops - File operations supported by the keyboard driver
  * @owner:  The keyboard driver owns the file operations; this ensures
@@ -114,6 +745,8 @@ static ssize_t keyboard_write(struct file *file, const char __user *buf, size_t
  *          still in use.
  * @read:   The read function.
  * @write:  The write function.
+ * @poll:   Reports whether key events are queued.
+ * @mmap:   Maps the register window into userspace.
  * @llseek: We use the kernel's default_llseek() function; this allows users
  *          to change what position they are writing/reading to/from.
  */
@@ -122,6 +755,8 @@ static const struct file_operations keyboard_fops =
 	.owner = THIS_MODULE,
 	.read = keyboard_read,
 	.write = keyboard_write,
+	.poll = keyboard_poll,
+	.mmap = keyboard_mmap,
 	.llseek = default_llseek,
 };
 
@@ -150,6 +785,9 @@ static int keyboard_probe(struct platform_device *pdev)
 	 * is automatically freed when the device is removed.
 	 */
 	struct keyboard_dev *priv;
+	struct resource *res;
+	int err;
+	u32 word;
 	priv = devm_kzalloc(&pdev->dev, sizeof(struct keyboard_dev), GFP_KERNEL);
 	if (!priv)
 	{
@@ -163,15 +801,90 @@ static int keyboard_probe(struct platform_device *pdev)
 	 * into the kernel's virtual address space because we don't have access
 	 * to physical memory locations.
 	 */
-	priv->base_addr = devm_platform_ioremap_resource(pdev, 0);
+	priv->base_addr = devm_platform_get_and_ioremap_resource(pdev, 0, &res);
 	if (IS_ERR(priv->base_addr))
 	{
 		pr_err("Failed to request/remap platform device resource.\n");
 		return PTR_ERR(priv->base_addr);
 	}
+	priv->phys_addr = res->start;
+	priv->span = resource_size(res);
+	
+	mutex_init(&priv->lock);
+	init_waitqueue_head(&priv->wait);
+	spin_lock_init(&priv->drain_lock);
+	
+	err = fpga_stats_init(&pdev->dev, &priv->stats);
+	if (err)
+	{
+		pr_err("Failed to set up stats.\n");
+		return err;
+	}
 	
 	// Set the memory addresses for each register.
-	priv->kb_buffer = priv->base_addr;
+	priv->kb_buffer = priv->base_addr + KB_BUFFER_OFFSET;
+	priv->irq_status = priv->base_addr + IRQ_STATUS_OFFSET;
+	priv->ctrl = priv->base_addr + CTRL_OFFSET;
+	priv->fifo_data = priv->base_addr + FIFO_DATA_OFFSET;
+	
+	// The input device must outlive the interrupt and the poll timer, which push events into it.
+	if (keyboard_input_register(priv, &pdev->dev))
+	{
+		pr_err("Failed to register the input device.\n");
+		return -ENODEV;
+	}
+	
+	if (kfifo_alloc(&priv->events, EVENT_QUEUE_SIZE, GFP_KERNEL))
+	{
+		pr_err("Failed to allocate the event queue.\n");
+		return -ENOMEM;
+	}
+	hrtimer_init(&priv->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	priv->poll_timer.function = keyboard_poll_fn;
+	if (devm_add_action_or_reset(&pdev->dev, keyboard_events_release, priv))
+	{
+		return -ENOMEM;
+	}
+	
+	/**
+	 * Find out whether the bitstream has the hardware FIFO. Codes latched
+	 * before the driver loaded are stale, so the FIFO is emptied.
+	 */
+	word = ioread32(priv->fifo_data);
+	priv->has_fifo = word & FIFO_PRESENT;
+	while ((word & FIFO_VALID) && FIELD_GET(FIFO_LEVEL, word) > 1)
+	{
+		word = ioread32(priv->fifo_data);
+	}
+	priv->last = ioread32(priv->kb_buffer);
+	
+	// Bitstreams with the scan controls never read a zero scan period.
+	priv->has_scan_ctrl = FIELD_GET(CTRL_SCAN_PERIOD, ioread32(priv->ctrl)) != 0;
+	
+	/**
+	 * Use the key event interrupt if the device tree node has one. Older
+	 * bitstreams don't, and the poll timer watches kb_buffer instead.
+	 */
+	priv->irq = platform_get_irq_optional(pdev, 0);
+	if (priv->irq == -EPROBE_DEFER)
+	{
+		return priv->irq;
+	}
+	if (priv->irq > 0)
+	{
+		iowrite32(0xFFFFFFFF, priv->irq_status);
+		if (devm_request_irq(&pdev->dev, priv->irq, keyboard_irq, 0, "keyboard", priv))
+		{
+			pr_err("Failed to request the keyboard interrupt.\n");
+			return -EBUSY;
+		}
+		keyboard_ctrl_update(priv, CTRL_IRQ_ENABLE, IRQ_NEW_CODE | IRQ_OVERFLOW);
+	}
+	else
+	{
+		pr_info("keyboard: no interrupt, polling kb_buffer every %u us.\n", POLL_INTERVAL_US);
+		hrtimer_start(&priv->poll_timer, 0, HRTIMER_MODE_REL_SOFT);
+	}
 	
 	// Initialze the misc device parameters
 	priv->miscdev.minor = MISC_DYNAMIC_MINOR;
@@ -212,6 +925,9 @@ static int keyboard_remove(struct platform_device *pdev)
 	// Get the keyboard's private data from the platform device.
 	struct keyboard_dev *priv = platform_get_drvdata(pdev);
 	
+	// Stop the interrupt before devm releases the handler.
+	keyboard_ctrl_update(priv, CTRL_IRQ_ENABLE, 0);
+	
 	// Deregister the misc device and remove the /dev/keyboard file.
 	misc_deregister(&priv->miscdev);
 	
@@ -231,6 +947,7 @@ static int keyboard_remove(struct platform_device *pdev)
  * @driver.owner:          Which module owns this driver
  * @driver.name:           Name of driver
  * @driver.of_match_table: Device tree match table
+ * @driver.dev_groups:     sysfs attribute groups of the device
  */
 static struct platform_driver keyboard_driver = {
 	.probe = keyboard_probe,
@@ -239,6 +956,7 @@ static struct platform_driver keyboard_driver = {
 		.owner = THIS_MODULE,
 		.name = "keyboard",
 		.of_match_table = keyboard_of_match,
+		.dev_groups = keyboard_groups,
 	},
 };
 
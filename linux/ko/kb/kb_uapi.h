@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 or MIT */
+/*
+ * Userspace interface for the calculator keyboard driver.
+ *
+ * This header is shared by the kernel module and by userspace programs that
+ * talk to /dev/keyboard, so it only uses the exported linux/ types.
+ */
+#ifndef _KB_UAPI_H
+#define _KB_UAPI_H
+
+#include <linux/types.h>
+
+/**
+ * struct kb_event - One key press or release.
+ * @timestamp_ns: CLOCK_MONOTONIC time the driver saw the event.
+ * @code:         Key code, the low byte of kb_buffer (e.g. 0x47 for '7').
+ * @pressed:      1 for a press, 0 for a release.
+ * @reserved:     Always zero.
+ *
+ * read() on /dev/keyboard returns whole records of this type, as many as fit
+ * in the buffer. Blocking reads wait for the first event; poll() reports the
+ * file readable while events are queued.
+ */
+struct kb_event {
+	__s64 timestamp_ns;
+	__u16 code;
+	__u16 pressed;
+	__u32 reserved;
+};
+
+#endif /* _KB_UAPI_H */
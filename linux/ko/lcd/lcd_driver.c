@@ -13,15 +13,62 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/kstrtox.h>
+#include <linux/mm.h>
 #include <linux/delay.h>
+#include <linux/iopoll.h>
+#include <linux/workqueue.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/bitmap.h>
+#include <linux/bitfield.h>
 
+#include "../fpga_stats.h"
+#include "lcd_uapi.h"
 
 
-#define LCD_WAIT 5		/* How long to wait between writes to
-						 * registers in milliseconds */
 
 #define CONTROL_OFFSET 0x0
 #define DATA_OFFSET 0x4
+#define STATUS_OFFSET 0x8
+#define FIFO_OFFSET 0xC
+
+#define LCD_CTL_E 0x1		// Enable strobe; the LCD latches on its falling edge
+#define LCD_CTL_RS 0x4		// Register select: 0 = instruction, 1 = data
+
+#define STATUS_BUSY BIT(0)		// The LCD is still executing the last instruction
+#define STATUS_FIFO BIT(30)		// Always set by bitstreams that have the command FIFO
+#define STATUS_PRESENT BIT(31)	// Always set by bitstreams that have the status register
+
+#define FIFO_FREE GENMASK(8, 0)	// fifo register: free entries in the command FIFO
+#define LCD_FIFO_DEPTH 256
+
+/*
+ * HD44780 timings. E must stay high for 230 ns within a 500 ns cycle; clear
+ * display and return home execute in 1.52 ms, everything else in 37 us plus
+ * 4 us for data writes.
+ */
+#define LCD_PULSE_NS 500
+#define LCD_EXEC_US 41
+#define LCD_SLOW_EXEC_US 1520
+#define LCD_SLOW_POLL_US 100	// Sleep between status reads while a slow instruction runs
+#define LCD_TIMEOUT_US 5000		// Give up on a status register that never goes idle
+#define LCD_FIFO_TIMEOUT_US 500000	// Longer than a full command FIFO of clears takes
+
+#define LCD_QUEUE_SIZE 256	// Queued LCD commands; must be a power of two for kfifo
+#define LCD_CMD_DATA 0x100	// Queue entry bit: the low byte is a character, not an instruction
+
+#define LCD_CLEAR 0x01		// Clear display instruction; fills DDRAM with spaces
+#define LCD_HOME 0x02		// Return home instruction
+#define LCD_SET_CGRAM 0x40	// Set CGRAM address instruction; OR in the address
+#define LCD_SET_DDRAM 0x80	// Set DDRAM address instruction; OR in the address
+
+#define LCD_COLS 40			// DDRAM cells per line in 2-line mode
+#define LCD_CELLS 80		// DDRAM cells of both lines
+#define LCD_LINE2_ADDR 0x40	// DDRAM address of the first cell of the second line
+
+#define LCD_MAX_WRITE LCD_CELLS	// Bytes a write() can cover
+#define LCD_MAX_CMDS (2 * LCD_MAX_WRITE + 1)	// Commands one write() can turn into
+#define LCD_GLYPH_CMDS (LCD_GLYPH_SLOTS * (LCD_GLYPH_ROWS + 1) + 1)	// Commands one glyph load can turn into
 
 #define BYTE_SIZE 16
 
@@ -43,6 +90,9 @@ static const struct of_device_id lcd_of_match[] =
  * @base_addr:  Pointer to the component's base address
  * @control:    Address of the control register
  * @data:       Address of the data register
+ * @status:     Address of the status register
+ * @fifo:       Address of the command FIFO register; writes queue a command
+ *              (bit 8 = RS), reads return the free entries
  * @lcd_status: Status bits of LCD (D S O R B _ N F)
  * 				Bit 7: Direction that cursor moves
  * 					0 = left
@@ -66,8 +116,37 @@ static const struct of_device_id lcd_of_match[] =
  * 				Bit 0: Font size
  * 					0 = 5x8 pixels
  * 					1 = 5x11 pixels
+ * @phys_addr:  Physical base address of the register window
+ * @span:       Size of the register window in bytes
  * @miscdev:    miscdevice used to create a character device
- * @lock:       mutex used to prevent concurrent writes to memory
+ * @lock:       mutex that serializes writers queueing commands
+ * @stats:      Latency and throughput counters, exposed in debugfs
+ * @has_status: The bitstream reports when the LCD is busy; without it the
+ *              driver sleeps for the datasheet execution times
+ * @has_fifo:   The bitstream times the LCD strobes itself from a command FIFO
+ * @burst:      Commands on their way into the command FIFO, used by @work
+ * @wq:         Ordered workqueue whose single @work talks to the LCD
+ * @work:       Drains @cmds into the LCD
+ * @cmds:       Queue of LCD commands; writers produce under @lock, @work
+ *              consumes
+ * @queued:     Number of commands ever queued, under @lock
+ * @done:       Number of commands ever sent to the LCD by @work
+ * @error:      First error @work hit since the last fsync()
+ * @wait:       Wait queue of writers waiting for queue space or completion
+ * @shadow:     DDRAM contents once the queued commands have run, indexed by
+ *              cell (0--39 first line, 40--79 second line), under @lock
+ * @shadow_valid: Bit n is set if @shadow[n] is known to match the LCD
+ * @cursor:     Cell the LCD's address counter will point at once the queued
+ *              commands have run, or -1 if unknown
+ * @mappings:   Number of userspace mappings of the register window; while
+ *              there are any, the shadow can't be trusted
+ * @writes_skipped: Number of characters not sent because the LCD already
+ *              showed them
+ * @glyphs:     CGRAM contents once the queued commands have run, under @lock
+ * @glyph_valid: Bit n is set if @glyphs[n] is known to match the LCD
+ * @glyph_used: @glyph_clock value of the last request for each slot
+ * @glyph_clock: Counter that orders glyph requests for the LRU
+ * @glyphs_skipped: Number of glyph uploads saved because CGRAM had the glyph
  *
  * lcd_dev struct gets created for each lcd component.
  */
@@ -76,10 +155,550 @@ struct lcd_dev
 	void __iomem *base_addr;
 	void __iomem *control;
 	void __iomem *data;
+	void __iomem *status;
+	void __iomem *fifo;
 	u8 lcd_status;
+	phys_addr_t phys_addr;
+	resource_size_t span;
 	struct miscdevice miscdev;
 	struct mutex lock;
+	struct fpga_stats stats;
+	bool has_status;
+	bool has_fifo;
+	u32 burst[LCD_FIFO_DEPTH];
+	struct workqueue_struct *wq;
+	struct work_struct work;
+	DECLARE_KFIFO_PTR(cmds, u16);
+	unsigned long queued;
+	unsigned long done;
+	int error;
+	wait_queue_head_t wait;
+	u8 shadow[LCD_CELLS];
+	DECLARE_BITMAP(shadow_valid, LCD_CELLS);
+	int cursor;
+	atomic_t mappings;
+	unsigned long writes_skipped;
+	struct lcd_glyph glyphs[LCD_GLYPH_SLOTS];
+	unsigned long glyph_valid;
+	unsigned long glyph_used[LCD_GLYPH_SLOTS];
+	unsigned long glyph_clock;
+	unsigned long glyphs_skipped;
+};
+
+
+
+// LCD COMMANDS ---------------------------------------------------------------
+
+/**
+ * lcd_wait() - Wait for the LCD to finish the last instruction.
+ * @priv: The lcd device.
+ * @slow: The instruction was clear display or return home.
+ *
+ * Polls the busy bit of the status register. Short instructions finish in
+ * tens of microseconds, so the poll spins; slow ones sleep between reads.
+ * Bitstreams without the status register get the datasheet execution time
+ * instead.
+ *
+ * Return: 0 on success, or -ETIMEDOUT if the LCD stayed busy.
+ */
+static int lcd_wait(struct lcd_dev *priv, bool slow)
+{
+	u32 status;
+	
+	if (!priv->has_status)
+	{
+		if (slow)
+		{
+			usleep_range(LCD_SLOW_EXEC_US, LCD_SLOW_EXEC_US + 200);
+		}
+		else
+		{
+			usleep_range(LCD_EXEC_US, LCD_EXEC_US + 10);
+		}
+		return 0;
+	}
+	
+	return read_poll_timeout(fpga_stats_ioread32, status, !(status & STATUS_BUSY),
+	                         slow ? LCD_SLOW_POLL_US : 0, LCD_TIMEOUT_US, false,
+	                         &priv->stats, priv->status);
+}
+
+
+
+/**
+ * lcd_send() - Send one instruction or character to the LCD.
+ * @priv: The lcd device.
+ * @ctl:  LCD_CTL_RS for a character, 0 for an instruction.
+ * @byte: The instruction or character.
+ *
+ * Puts @byte on the data bus, pulses E, and waits until the LCD can take the
+ * next byte. Only the queue worker, and probe before the queue exists, talk
+ * to the LCD, so this needs no lock.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int lcd_send(struct lcd_dev *priv, u32 ctl, u8 byte)
+{
+	fpga_stats_iowrite32(&priv->stats, byte, priv->data);
+	fpga_stats_iowrite32(&priv->stats, ctl | LCD_CTL_E, priv->control);
+	ndelay(LCD_PULSE_NS);
+	fpga_stats_iowrite32(&priv->stats, 0x00000000, priv->control);
+	
+	return lcd_wait(priv, !(ctl & LCD_CTL_RS) && byte && byte <= 0x03);
+}
+
+
+
+/**
+ * lcd_work_fifo() - Burst queued commands into the hardware command FIFO.
+ * @priv: The lcd device.
+ *
+ * Each burst fills the free entries the FIFO reports with one
+ * iowrite32_rep(), so a whole screen goes out without a handshake per
+ * command; the FIFO then strobes the LCD at its own pace. Completion is
+ * published once the FIFO has drained. If it stops draining, the remaining
+ * commands are dropped and the error is kept for fsync().
+ */
+static void lcd_work_fifo(struct lcd_dev *priv)
+{
+	unsigned long pushed = priv->done;
+	unsigned int n, free;
+	u64 start;
+	u32 word;
+	u16 cmd;
+	int ret = 0;
+	
+	while (!kfifo_is_empty(&priv->cmds))
+	{
+		ret = read_poll_timeout(fpga_stats_ioread32, word, FIELD_GET(FIFO_FREE, word),
+		                        LCD_SLOW_POLL_US, LCD_FIFO_TIMEOUT_US, false,
+		                        &priv->stats, priv->fifo);
+		if (ret)
+		{
+			break;
+		}
+		
+		free = FIELD_GET(FIFO_FREE, word);
+		for (n = 0; n < free && kfifo_get(&priv->cmds, &cmd); n++)
+		{
+			priv->burst[n] = cmd;	// LCD_CMD_DATA is the FIFO's RS bit
+		}
+		
+		// The burst is accounted as a single register write.
+		start = fpga_stats_start(&priv->stats);
+		iowrite32_rep(priv->fifo, priv->burst, n);
+		fpga_stats_end(&priv->stats, FPGA_STAT_MMIO_WRITE, start);
+		
+		pushed += n;
+		wake_up_interruptible(&priv->wait);
+	}
+	
+	if (!ret)
+	{
+		ret = read_poll_timeout(fpga_stats_ioread32, word, !(word & STATUS_BUSY),
+		                        LCD_SLOW_POLL_US, LCD_FIFO_TIMEOUT_US, false,
+		                        &priv->stats, priv->status);
+	}
+	if (ret)
+	{
+		while (kfifo_get(&priv->cmds, &cmd))
+		{
+			pushed++;
+		}
+		if (!READ_ONCE(priv->error))
+		{
+			WRITE_ONCE(priv->error, ret);
+		}
+	}
+	
+	smp_store_release(&priv->done, pushed);
+	wake_up_interruptible(&priv->wait);
+}
+
+
+
+/**
+ * lcd_work_fn() - Send queued commands to the LCD.
+ * @work: The lcd device's work.
+ *
+ * Runs on an ordered workqueue, so it is the only consumer of @cmds. With
+ * the command FIFO, commands go out in bursts. Otherwise each one is strobed
+ * by hand, and writers waiting for space or for their commands to complete
+ * are woken after every command.
+ */
+static void lcd_work_fn(struct work_struct *work)
+{
+	struct lcd_dev *priv = container_of(work, struct lcd_dev, work);
+	u16 cmd;
+	int ret;
+	
+	if (priv->has_fifo)
+	{
+		lcd_work_fifo(priv);
+		return;
+	}
+	
+	while (kfifo_get(&priv->cmds, &cmd))
+	{
+		ret = lcd_send(priv, (cmd & LCD_CMD_DATA) ? LCD_CTL_RS : 0, cmd & 0xFF);
+		if (ret && !READ_ONCE(priv->error))
+		{
+			WRITE_ONCE(priv->error, ret);
+		}
+		
+		// Publish the count only after the command reached the LCD.
+		smp_store_release(&priv->done, priv->done + 1);
+		wake_up_interruptible(&priv->wait);
+	}
+}
+
+
+
+/**
+ * lcd_queue_begin() - Wait for room in the command queue and lock it.
+ * @priv:     The lcd device.
+ * @n:        Number of commands the caller may queue, at most LCD_QUEUE_SIZE.
+ * @nonblock: Fail with -EAGAIN instead of waiting for queue space.
+ *
+ * On success, @priv->lock is held until lcd_queue_end(), so the commands of
+ * one write are queued together and never interleave with another's.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int lcd_queue_begin(struct lcd_dev *priv, unsigned int n, bool nonblock)
+{
+	int ret;
+	
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	while (kfifo_avail(&priv->cmds) < n)
+	{
+		mutex_unlock(&priv->lock);
+		if (nonblock)
+		{
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(priv->wait, kfifo_avail(&priv->cmds) >= n);
+		if (ret)
+		{
+			return ret;
+		}
+		fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	}
+	
+	return 0;
+}
+
+/**
+ * lcd_queue_end() - Queue commands for the LCD and unlock the queue.
+ * @priv: The lcd device; the caller holds @priv->lock from lcd_queue_begin().
+ * @cmds: The commands; LCD_CMD_DATA marks characters.
+ * @n:    Number of commands, at most what lcd_queue_begin() made room for.
+ * @seq:  Set to the value @priv->done reaches once the commands are sent.
+ */
+static void lcd_queue_end(struct lcd_dev *priv, const u16 *cmds, unsigned int n, unsigned long *seq)
+{
+	kfifo_in(&priv->cmds, cmds, n);
+	priv->queued += n;
+	*seq = priv->queued;
+	mutex_unlock(&priv->lock);
+	
+	if (n)
+	{
+		queue_work(priv->wq, &priv->work);
+	}
+}
+
+
+
+/**
+ * lcd_sync() - Wait until queued commands have reached the LCD.
+ * @priv: The lcd device.
+ * @seq:  Value of @priv->done to wait for, from lcd_queue().
+ *
+ * Return: 0 on success, the first error the worker hit since the last sync,
+ * or -ERESTARTSYS if interrupted.
+ */
+static int lcd_sync(struct lcd_dev *priv, unsigned long seq)
+{
+	int ret;
+	
+	ret = wait_event_interruptible(priv->wait, (long)(smp_load_acquire(&priv->done) - seq) >= 0);
+	if (ret)
+	{
+		return ret;
+	}
+	
+	return xchg(&priv->error, 0);
+}
+
+
+
+/**
+ * lcd_release_queue() - devm action that tears the command queue down.
+ * @data: The lcd device.
+ *
+ * Runs after the misc device is gone, so nobody can queue more commands.
+ * destroy_workqueue() lets the worker finish the ones already queued.
+ */
+static void lcd_release_queue(void *data)
+{
+	struct lcd_dev *priv = data;
+	
+	destroy_workqueue(priv->wq);
+	kfifo_free(&priv->cmds);
+}
+
+// END OF LCD COMMANDS --------------------------------------------------------
+
+
+
+// SHADOW FRAMEBUFFER ---------------------------------------------------------
+
+/**
+ * lcd_ddram_addr() - Return the DDRAM address of a cell.
+ * @cell: Cell index, 0--39 on the first line and 40--79 on the second.
+ *
+ * Return: The address for a set DDRAM address instruction.
+ */
+static u8 lcd_ddram_addr(unsigned int cell)
+{
+	return cell < LCD_COLS ? cell : LCD_LINE2_ADDR + cell - LCD_COLS;
+}
+
+
+
+/**
+ * lcd_shadow_diff() - Turn a write into the commands that change the LCD.
+ * @priv: The lcd device; the caller holds @priv->lock.
+ * @ops:  Characters (LCD_CMD_DATA) and LCD_CLEAR/LCD_HOME instructions, in
+ *        order.
+ * @n:    Number of @ops.
+ * @pos:  Cell the first character goes to; updated to the cell after the
+ *        last one, which is LCD_CELLS after writing the last cell.
+ * @cmds: Filled with the commands, at most 2 * @n + 1 of them.
+ *
+ * Characters the shadow says the LCD already shows are skipped. Each run of
+ * changed characters costs one set DDRAM address instruction, unless the
+ * address counter is already there, plus one command per character. The
+ * address counter is left on @pos so the cursor shows where the text ended;
+ * after the last cell it wraps to the first, like the LCD's does.
+ *
+ * While userspace has the register window mapped, no character is skipped,
+ * since the LCD may show anything. The address counter is still tracked
+ * within the write, so a run of characters keeps costing one set DDRAM
+ * address instruction; only its position at the start of the write is
+ * unknown.
+ *
+ * Return: The number of commands in @cmds.
+ */
+static unsigned int lcd_shadow_diff(struct lcd_dev *priv, const u16 *ops, unsigned int n,
+	unsigned int *pos, u16 *cmds)
+{
+	bool trusted = !atomic_read(&priv->mappings);
+	unsigned int i;
+	unsigned int k = 0;
+	u8 c;
+	
+	if (!trusted)
+	{
+		priv->cursor = -1;
+	}
+	
+	for (i = 0; i < n; i++)
+	{
+		if (!(ops[i] & LCD_CMD_DATA))
+		{
+			// Clear display fills DDRAM with spaces; both move the cursor home.
+			cmds[k++] = ops[i];
+			if (ops[i] == LCD_CLEAR)
+			{
+				memset(priv->shadow, ' ', LCD_CELLS);
+				if (trusted)
+				{
+					bitmap_fill(priv->shadow_valid, LCD_CELLS);
+				}
+			}
+			priv->cursor = 0;
+			*pos = 0;
+			continue;
+		}
+		
+		c = ops[i] & 0xFF;
+		if (trusted && test_bit(*pos, priv->shadow_valid) && priv->shadow[*pos] == c)
+		{
+			priv->writes_skipped++;
+		}
+		else
+		{
+			if (priv->cursor != (int)*pos)
+			{
+				cmds[k++] = LCD_SET_DDRAM | lcd_ddram_addr(*pos);
+			}
+			cmds[k++] = LCD_CMD_DATA | c;
+			priv->shadow[*pos] = c;
+			assign_bit(*pos, priv->shadow_valid, trusted);
+			priv->cursor = (*pos + 1) % LCD_CELLS;
+		}
+		(*pos)++;
+	}
+	
+	if (*pos < LCD_CELLS && priv->cursor != (int)*pos)
+	{
+		cmds[k++] = LCD_SET_DDRAM | lcd_ddram_addr(*pos);
+		priv->cursor = *pos;
+	}
+	
+	return k;
+}
+
+
+
+/**
+ * lcd_glyph_load() - Turn a glyph request into the commands that load CGRAM.
+ * @priv: The lcd device; the caller holds @priv->lock.
+ * @req:  The validated request; @req->codes is filled in.
+ * @cmds: Filled with the commands, at most LCD_GLYPH_CMDS of them.
+ *
+ * Each glyph is looked up in the CGRAM shadow first. A miss takes an empty
+ * slot, or else the least recently requested slot that this request hasn't
+ * claimed, and costs a set CGRAM address plus one command per row. Writing
+ * CGRAM moves the address counter there, so a set DDRAM address afterwards
+ * puts it back under the cursor.
+ *
+ * Return: The number of commands in @cmds.
+ */
+static unsigned int lcd_glyph_load(struct lcd_dev *priv, struct lcd_glyphs *req, u16 *cmds)
+{
+	bool trusted = !atomic_read(&priv->mappings);
+	unsigned long claimed = 0;
+	unsigned int i, row, slot, victim;
+	unsigned int k = 0;
+	
+	for (i = 0; i < req->count; i++)
+	{
+		for (slot = 0; slot < LCD_GLYPH_SLOTS; slot++)
+		{
+			if (trusted && (priv->glyph_valid & BIT(slot))
+				&& !memcmp(&priv->glyphs[slot], &req->glyphs[i], sizeof(struct lcd_glyph)))
+			{
+				break;
+			}
+		}
+		
+		if (slot < LCD_GLYPH_SLOTS)
+		{
+			priv->glyphs_skipped++;
+		}
+		else
+		{
+			// Prefer an empty slot, then the least recently requested one.
+			victim = LCD_GLYPH_SLOTS;
+			for (slot = 0; slot < LCD_GLYPH_SLOTS; slot++)
+			{
+				if (claimed & BIT(slot))
+				{
+					continue;
+				}
+				if (!(priv->glyph_valid & BIT(slot)))
+				{
+					victim = slot;
+					break;
+				}
+				if (victim == LCD_GLYPH_SLOTS
+					|| (long)(priv->glyph_used[slot] - priv->glyph_used[victim]) < 0)
+				{
+					victim = slot;
+				}
+			}
+			slot = victim;
+			
+			cmds[k++] = LCD_SET_CGRAM | (slot * LCD_GLYPH_ROWS);
+			for (row = 0; row < LCD_GLYPH_ROWS; row++)
+			{
+				cmds[k++] = LCD_CMD_DATA | req->glyphs[i].rows[row];
+			}
+			priv->glyphs[slot] = req->glyphs[i];
+			if (trusted)
+			{
+				priv->glyph_valid |= BIT(slot);
+			}
+			else
+			{
+				priv->glyph_valid &= ~BIT(slot);
+			}
+		}
+		
+		priv->glyph_used[slot] = ++priv->glyph_clock;
+		claimed |= BIT(slot);
+		req->codes[i] = slot;
+	}
+	
+	if (k && priv->cursor >= 0)
+	{
+		cmds[k++] = LCD_SET_DDRAM | lcd_ddram_addr(priv->cursor);
+	}
+	
+	return k;
+}
+
+// END OF SHADOW FRAMEBUFFER --------------------------------------------------
+
+
+
+// ATTRIBUTES -----------------------------------------------------------------
+
+/**
+ * writes_skipped_show() - Return the number of characters the shadow saved.
+ * @dev:  Device structure for the lcd component. This is embedded
+ *        in the lcd's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t writes_skipped_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct lcd_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(priv->writes_skipped));
+}
+
+
+
+/**
+ * glyphs_skipped_show() - Return the number of glyph uploads the cache saved.
+ * @dev:  Device structure for the lcd component. This is embedded
+ *        in the lcd's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t glyphs_skipped_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct lcd_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(priv->glyphs_skipped));
+}
+
+
+
+// Define sysfs attributes
+static DEVICE_ATTR_RO(writes_skipped);
+static DEVICE_ATTR_RO(glyphs_skipped);
+
+// Create an attribute group so the device core can export attributes for us
+static struct attribute *lcd_attrs[] =
+{
+	&dev_attr_writes_skipped.attr,
+	&dev_attr_glyphs_skipped.attr,
+	NULL,
 };
+ATTRIBUTE_GROUPS(lcd);
+
+// END OF ATTRIBUTES ----------------------------------------------------------
 
 
 
@@ -105,94 +724,344 @@ static ssize_t lcd_read(struct file *file, char __user *buf, size_t count, loff_
 
 
 /**
- * lcd_write() - Write method for the lcd char device
+ * lcd_do_write() - Write method for the lcd char device
  * @file:   Pointer to the char device file struct.
  * @buf:    User-space buffer to read the value from.
  * @count:  The number of bytes being written.
  * @offset: The byte offset in the file being written to.
  *
- * Return: On success, the number of bytes written is returned and the
- * offset @offset is advanced by this number. On error, a negative error
- * value is returned.
+ * File offsets are DDRAM cells: 0--39 are the first line (DDRAM 0x00--0x27)
+ * and 40--79 the second (0x40--0x67), so pwrite() updates a field in place.
+ * Validates the text, turns it into LCD commands, and queues them for the
+ * worker, so the call returns without waiting for the LCD. Characters the
+ * LCD already shows are not sent again. The escapes \c (clear display) and
+ * \h (return home) move the offset back to 0, and a trailing newline is
+ * ignored. Opening the file O_SYNC or O_DSYNC makes the call wait until the
+ * text is on the LCD.
+ *
+ * Return: On success, the number of bytes consumed is returned and the
+ * offset @offset is moved to the new cursor position. On error, a negative
+ * error value is returned; -ENOSPC if @offset is past the last cell.
  */
-static ssize_t lcd_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
+static ssize_t lcd_do_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
 {
-	char user_buf[16];	
+	char user_buf[LCD_MAX_WRITE];
+	u16 ops[LCD_MAX_WRITE];
+	u16 cmds[LCD_MAX_CMDS];
 	struct lcd_dev *priv = container_of(file->private_data, struct lcd_dev, miscdev);
 	size_t bytes_to_copy = 0;
-	size_t bytes_copied = 0;
-	size_t bytes_written = 0;
+	unsigned int n = 0;
+	unsigned int pos = *offset;
+	unsigned long seq;
+	size_t i;
+	int ret;
 	
 	if (*offset < 0)
 	{
 		return -EINVAL;
-	}	
-	if (*offset >= 16)
+	}
+	if (*offset >= LCD_CELLS)
 	{
-		pr_warn("lcd_write: Cursor past end of LCD screen.\n");
-		return 0;
+		return count ? -ENOSPC : 0;
 	}
 	
 	// Get the value from userspace.
-	bytes_to_copy = min(count, (size_t)(16 - *offset));
-	
-	bytes_copied = bytes_to_copy - copy_from_user(user_buf, buf, count);
-	if (bytes_copied == 0)
+	bytes_to_copy = min(count, (size_t)(LCD_CELLS - *offset));
+	if (copy_from_user(user_buf, buf, bytes_to_copy))
 	{
-		pr_warn("lcd_write: Zero bytes copied from userspace.\n");
+		pr_warn("lcd_write: Failed to copy from userspace.\n");
 		return -EFAULT;
 	}
 	
-	// Lock device so no other process can access it.
-	mutex_lock(&priv->lock);
+	// Translate the escapes into LCD instructions.
+	for (i = 0; i < bytes_to_copy; i++)
+	{
+		if (user_buf[i] == '\n' && i == bytes_to_copy - 1)
+		{
+			break;
+		}
+		if (user_buf[i] == '\\' && i + 1 < bytes_to_copy)
+		{
+			switch (user_buf[i + 1])
+			{
+			case 'c': ops[n++] = LCD_CLEAR; i++; continue; // Clear display
+			case 'h': ops[n++] = LCD_HOME; i++; continue; // return Home
+		//	case 'd': // Direction
+		//	case 's': // Shift
+		//	case 'o': // On/Off
+		//	case 'r': // cuRsoR
+		//	case 'b': // Blink
+		//	case 'n': // line Number
+		//	case 'f': // Font size
+			default:  break; // Anything else is shown as is
+			}
+		}
+		
+		ops[n++] = LCD_CMD_DATA | (u8)user_buf[i];
+	}
 	
-	// Write data to the LCD
-	u32 instruction;
-	for (bytes_written = 0; bytes_written < bytes_to_copy - 1; bytes_written++)
+	if (n)
 	{
-		if ((user_buf[bytes_written] == '\\')
-			&& (bytes_written < bytes_to_copy - 2))
+		// Only the cells that change are sent.
+		ret = lcd_queue_begin(priv, 2 * n + 1, file->f_flags & O_NONBLOCK);
+		if (ret)
 		{
-			switch (user_buf[bytes_written + 1])
+			return ret;
+		}
+		n = lcd_shadow_diff(priv, ops, n, &pos, cmds);
+		lcd_queue_end(priv, cmds, n, &seq);
+		*offset = pos;
+		
+		if (file->f_flags & O_DSYNC)
+		{
+			ret = lcd_sync(priv, seq);
+			if (ret)
 			{
-			case 'c': iowrite32(0x00000001, priv->data); break; // Clear display
-			case 'h': iowrite32(0x00000002, priv->data); break; // return Home
-		//	case 'd':
-		//		if () {
-		//			iowrite32(0x00000000, priv->data);
-		//		} else {
-		//			iowrite32(0x00000000, priv->data);
-		//		}
-		//		break; // Direction
-		//	case 's': iowrite32(0x00000000, priv->data); break; // Shift
-		//	case 'o': iowrite32(0x00000000, priv->data); break; // On/Off
-		//	case 'r': iowrite32(0x00000000, priv->data); break; // cuRsoR
-		//	case 'b': iowrite32(0x00000000, priv->data); break; // Blink
-		//	case 'n': iowrite32(0x00000000, priv->data); break; // line Number
-		//	case 'f': iowrite32(0x00000000, priv->data); break; // Font size
-			default:  iowrite32(0x00000000, priv->data); break;
+				return ret;
+			}
+		}
+	}
+	
+	return bytes_to_copy;
+}
+
+
+
+/**
+ * lcd_fsync() - Fsync method for the lcd char device
+ * @file:     Pointer to the char device file struct.
+ * @start:    Unused.
+ * @end:      Unused.
+ * @datasync: Unused.
+ *
+ * Waits until every command queued so far, by any writer, is on the LCD.
+ *
+ * Return: 0 on success, or the first error the worker hit since the last
+ * sync.
+ */
+static int lcd_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct lcd_dev *priv = container_of(file->private_data, struct lcd_dev, miscdev);
+	
+	return lcd_sync(priv, READ_ONCE(priv->queued));
+}
+
+
+
+/**
+ * lcd_do_ioctl() - Ioctl method for the lcd char device
+ * @file: Pointer to the char device file struct.
+ * @cmd:  One of the LCD_IOC_* commands from lcd_uapi.h.
+ * @arg:  Pointer to a struct lcd_glyphs in userspace.
+ *
+ * The glyph upload is queued like a write, so text written after the call
+ * returns already shows the new glyphs.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static long lcd_do_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct lcd_dev *priv = container_of(file->private_data, struct lcd_dev, miscdev);
+	struct lcd_glyphs req;
+	u16 cmds[LCD_GLYPH_CMDS];
+	unsigned long seq;
+	unsigned int i, row, n;
+	int ret;
+	
+	switch (cmd)
+	{
+	case LCD_IOC_LOAD_GLYPHS:
+		if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		{
+			return -EFAULT;
+		}
+		if (req.count < 1 || req.count > LCD_GLYPH_SLOTS || req.reserved)
+		{
+			return -EINVAL;
+		}
+		for (i = 0; i < req.count; i++)
+		{
+			for (row = 0; row < LCD_GLYPH_ROWS; row++)
+			{
+				if (req.glyphs[i].rows[row] & ~0x1F)
+				{
+					return -EINVAL;
+				}
 			}
-			msleep(LCD_WAIT);
-			iowrite32(0x00000001, priv->control);
-			msleep(LCD_WAIT);
-			iowrite32(0x00000000, priv->control);
-			msleep(LCD_WAIT);
 		}
 		
-		iowrite32((u32) user_buf[bytes_written], priv->data);
-		msleep(LCD_WAIT);
-		iowrite32(0x00000005, priv->control);
-		msleep(LCD_WAIT);
-		iowrite32(0x00000000, priv->control);
-		msleep(LCD_WAIT);
+		ret = lcd_queue_begin(priv, LCD_GLYPH_CMDS, file->f_flags & O_NONBLOCK);
+		if (ret)
+		{
+			return ret;
+		}
+		n = lcd_glyph_load(priv, &req, cmds);
+		lcd_queue_end(priv, cmds, n, &seq);
 		
-		(*offset)++;
+		if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+		{
+			return -EFAULT;
+		}
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+
+
+/*
+ * The write entry point times the whole syscall into the device's stats. The
+ * LCD command delays are only included for O_SYNC writes.
+ */
+static ssize_t lcd_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
+{
+	struct lcd_dev *priv = container_of(file->private_data, struct lcd_dev, miscdev);
+	u64 start = fpga_stats_start(&priv->stats);
+	ssize_t ret = lcd_do_write(file, buf, count, offset);
+	
+	fpga_stats_end(&priv->stats, FPGA_STAT_WRITE, start);
+	return ret;
+}
+
+static long lcd_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct lcd_dev *priv = container_of(file->private_data, struct lcd_dev, miscdev);
+	u64 start = fpga_stats_start(&priv->stats);
+	long ret = lcd_do_ioctl(file, cmd, arg);
+	
+	fpga_stats_end(&priv->stats, FPGA_STAT_IOCTL, start);
+	return ret;
+}
+
+
+
+/**
+ * lcd_llseek() - Llseek method for the lcd char device
+ * @file:   Pointer to the char device file struct.
+ * @offset: The offset to seek to, relative to @whence.
+ * @whence: SEEK_SET, SEEK_CUR, or SEEK_END; the end is after the last cell.
+ *
+ * Moves the file offset within the 80 DDRAM cells and queues one set DDRAM
+ * address instruction, so the LCD's cursor follows. Moving the cursor is
+ * best effort: with the queue full, the next write sets the address instead.
+ *
+ * Return: The new offset, or a negative error value.
+ */
+static loff_t lcd_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct lcd_dev *priv = container_of(file->private_data, struct lcd_dev, miscdev);
+	unsigned int n = 0;
+	unsigned long seq;
+	loff_t pos;
+	u16 cmd;
+	
+	pos = fixed_size_llseek(file, offset, whence, LCD_CELLS);
+	if (pos < 0 || pos == LCD_CELLS)
+	{
+		return pos;
 	}
 	
-	// Unlock device and return number of bytes written.
+	if (lcd_queue_begin(priv, 1, true))
+	{
+		return pos;
+	}
+	// Userspace may have moved the address counter through a mapping.
+	if (priv->cursor != pos || atomic_read(&priv->mappings))
+	{
+		cmd = LCD_SET_DDRAM | lcd_ddram_addr(pos);
+		n = 1;
+		priv->cursor = pos;
+	}
+	lcd_queue_end(priv, &cmd, n, &seq);
+	
+	return pos;
+}
+
+
+
+/**
+ * lcd_vma_open() - Count a new userspace mapping of the register window.
+ * @vma: The mapping, created by lcd_mmap() or copied by fork().
+ */
+static void lcd_vma_open(struct vm_area_struct *vma)
+{
+	struct lcd_dev *priv = vma->vm_private_data;
+	
+	atomic_inc(&priv->mappings);
+}
+
+/**
+ * lcd_vma_close() - Drop a userspace mapping of the register window.
+ * @vma: The mapping going away.
+ *
+ * Userspace may have written anything to the LCD through the mappings, so
+ * once the last one is gone the shadows start over and the next writes send
+ * every character and glyph.
+ */
+static void lcd_vma_close(struct vm_area_struct *vma)
+{
+	struct lcd_dev *priv = vma->vm_private_data;
+	
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	if (atomic_dec_and_test(&priv->mappings))
+	{
+		bitmap_zero(priv->shadow_valid, LCD_CELLS);
+		priv->cursor = -1;
+		priv->glyph_valid = 0;
+	}
 	mutex_unlock(&priv->lock);
+}
+
+static const struct vm_operations_struct lcd_vm_ops =
+{
+	.open = lcd_vma_open,
+	.close = lcd_vma_close,
+};
+
+
+
+/**
+ * lcd_mmap() - Mmap method for the lcd char device
+ * @file: Pointer to the char device file struct.
+ * @vma:  Userspace mapping being set up.
+ *
+ * Maps the lcd register window into userspace, uncached. The window must be
+ * page aligned and cover whole pages, so the mapping can't reach the
+ * registers of the components next to it; otherwise this fails with -EINVAL
+ * and text goes through write().
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int lcd_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct lcd_dev *priv = container_of(file->private_data, struct lcd_dev, miscdev);
+	int ret;
+	unsigned long pages = priv->span >> PAGE_SHIFT;
 	
-	return bytes_written;
+	if (!(vma->vm_flags & VM_SHARED) || !PAGE_ALIGNED(priv->phys_addr) ||
+		!PAGE_ALIGNED(priv->span))
+	{
+		return -EINVAL;
+	}
+	if (vma->vm_pgoff >= pages || vma_pages(vma) > pages - vma->vm_pgoff)
+	{
+		return -EINVAL;
+	}
+	
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	ret = vm_iomap_memory(vma, priv->phys_addr, priv->span);
+	if (ret)
+	{
+		return ret;
+	}
+	
+	// Bypass the shadow framebuffer for as long as the mapping exists.
+	vma->vm_private_data = priv;
+	vma->vm_ops = &lcd_vm_ops;
+	lcd_vma_open(vma);
+	
+	return 0;
 }
 
 
@@ -204,15 +1073,20 @@ static ssize_t lcd_write(struct file *file, const char __user *buf, size_t count
  *          still in use.
  * @read:   The read function.
  * @write:  The write function.
- * @llseek: We use the kernel's default_llseek() function; this allows users
- *          to change what position they are writing/reading to/from.
+ * @unlocked_ioctl: Custom glyph uploads, see lcd_uapi.h.
+ * @mmap:   Maps the register window into userspace.
+ * @fsync:  Waits for queued writes to reach the LCD.
+ * @llseek: Moves the file offset and the LCD's cursor to a DDRAM cell.
  */
 static const struct file_operations lcd_fops =
 {
 	.owner = THIS_MODULE,
 	.read = lcd_read,
 	.write = lcd_write,
-	.llseek = default_llseek,
+	.unlocked_ioctl = lcd_ioctl,
+	.mmap = lcd_mmap,
+	.fsync = lcd_fsync,
+	.llseek = lcd_llseek,
 };
 
 // END OF FILE OPERATIONS -----------------------------------------------------
@@ -240,6 +1114,9 @@ static int lcd_probe(struct platform_device *pdev)
 	 * is automatically freed when the device is removed.
 	 */
 	struct lcd_dev *priv;
+	struct resource *res;
+	int err;
+	u32 status;
 	priv = devm_kzalloc(&pdev->dev, sizeof(struct lcd_dev), GFP_KERNEL);
 	if (!priv)
 	{
@@ -253,55 +1130,73 @@ static int lcd_probe(struct platform_device *pdev)
 	 * into the kernel's virtual address space because we don't have access
 	 * to physical memory locations.
 	 */
-	priv->base_addr = devm_platform_ioremap_resource(pdev, 0);
+	priv->base_addr = devm_platform_get_and_ioremap_resource(pdev, 0, &res);
 	if (IS_ERR(priv->base_addr))
 	{
 		pr_err("Failed to request/remap platform device resource.\n");
 		return PTR_ERR(priv->base_addr);
 	}
+	priv->phys_addr = res->start;
+	priv->span = resource_size(res);
+	
+	mutex_init(&priv->lock);
+	
+	err = fpga_stats_init(&pdev->dev, &priv->stats);
+	if (err)
+	{
+		pr_err("Failed to set up stats.\n");
+		return err;
+	}
 	
 	// Set the memory addresses for each register.
 	priv->control = priv->base_addr + CONTROL_OFFSET;
 	priv->data = priv->base_addr + DATA_OFFSET;
+	priv->status = priv->base_addr + STATUS_OFFSET;
+	priv->fifo = priv->base_addr + FIFO_OFFSET;
 	
-	// Initialize LCD.
-	iowrite32(0x00000000, priv->control);
-	// Function set: 8-bit mode, 2-line display, 5x8 font
-	iowrite32(0x00000038, priv->data);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000001, priv->control);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000000, priv->control);
-	msleep(LCD_WAIT);
-	// Display on/off control: display on, cursor on, blink on
-	iowrite32(0x0000000F, priv->data);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000001, priv->control);
-	msleep(LCD_WAIT);
+	// Older bitstreams read 0 from the status register's address.
 	iowrite32(0x00000000, priv->control);
-	msleep(LCD_WAIT);
-	// Entry mode set: Increment and shift cursor, don't shift entire display
-	iowrite32(0x00000006, priv->data);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000001, priv->control);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000000, priv->control);
-	msleep(LCD_WAIT);
-	// Clear display
-	iowrite32(0x00000001, priv->data);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000001, priv->control);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000000, priv->control);
-	msleep(LCD_WAIT);
-	// Return home
-	iowrite32(0x00000002, priv->data);
-	msleep(LCD_WAIT);
-	iowrite32(0x00000001, priv->control);
-	msleep(LCD_WAIT);
+	status = ioread32(priv->status);
+	priv->has_status = status & STATUS_PRESENT;
+	priv->has_fifo = status & STATUS_FIFO;
+	
+	// Initialize LCD.
+	if (lcd_send(priv, 0, 0x38)		// Function set: 8-bit mode, 2-line display, 5x8 font
+		|| lcd_send(priv, 0, 0x0F)	// Display on/off control: display on, cursor on, blink on
+		|| lcd_send(priv, 0, 0x06)	// Entry mode set: Increment and shift cursor, don't shift entire display
+		|| lcd_send(priv, 0, 0x01)	// Clear display
+		|| lcd_send(priv, 0, 0x02))	// Return home
+	{
+		pr_err("LCD stayed busy during initialization.\n");
+		return -EIO;
+	}
 	// Clear registers
 	iowrite32(0x00000000, priv->data);
-	iowrite32(0x00000000, priv->control);
+	
+	// The init sequence cleared the display and left the cursor home.
+	memset(priv->shadow, ' ', LCD_CELLS);
+	bitmap_fill(priv->shadow_valid, LCD_CELLS);
+	priv->cursor = 0;
+	
+	// The worker owns the LCD from here on.
+	init_waitqueue_head(&priv->wait);
+	INIT_WORK(&priv->work, lcd_work_fn);
+	if (kfifo_alloc(&priv->cmds, LCD_QUEUE_SIZE, GFP_KERNEL))
+	{
+		pr_err("Failed to allocate the command queue.\n");
+		return -ENOMEM;
+	}
+	priv->wq = alloc_ordered_workqueue("lcd", 0);
+	if (!priv->wq)
+	{
+		kfifo_free(&priv->cmds);
+		pr_err("Failed to allocate the workqueue.\n");
+		return -ENOMEM;
+	}
+	if (devm_add_action_or_reset(&pdev->dev, lcd_release_queue, priv))
+	{
+		return -ENOMEM;
+	}
 	
 	// Update dev struct with LCD state info
 	priv->lcd_status = 0xBA;
@@ -364,6 +1259,7 @@ static int lcd_remove(struct platform_device *pdev)
  * @driver.owner:          Which module owns this driver
  * @driver.name:           Name of driver
  * @driver.of_match_table: Device tree match table
+ * @driver.dev_groups:     sysfs attribute groups of the device
  */
 static struct platform_driver lcd_driver = {
 	.probe = lcd_probe,
@@ -372,6 +1268,7 @@ static struct platform_driver lcd_driver = {
 		.owner = THIS_MODULE,
 		.name = "lcd",
 		.of_match_table = lcd_of_match,
+		.dev_groups = lcd_groups,
 	},
 };
 
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0 or MIT */
+/*
+ * Userspace interface for the lcd driver.
+ *
+ * This header is shared by the kernel module and by userspace programs that
+ * talk to /dev/lcd, so it only uses the exported linux/ types.
+ */
+#ifndef _LCD_UAPI_H
+#define _LCD_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* CGRAM holds this many 5x8 glyphs, shown by character codes 0 to 7 */
+#define LCD_GLYPH_SLOTS 8
+#define LCD_GLYPH_ROWS  8
+
+/**
+ * struct lcd_glyph - A 5x8 custom character.
+ * @rows: Pixel rows, top to bottom. Bit 4 is the leftmost pixel; bits 7:5
+ *        must be zero. The cursor is drawn over the bottom row.
+ */
+struct lcd_glyph {
+	__u8 rows[LCD_GLYPH_ROWS];
+};
+
+/**
+ * struct lcd_glyphs - Glyphs to make available on the LCD.
+ * @count:    Number of valid entries in @glyphs, 1 to LCD_GLYPH_SLOTS.
+ * @reserved: Must be zero.
+ * @glyphs:   The bitmaps.
+ * @codes:    Set by the driver: the character code (0 to 7) that shows each
+ *            glyph. Write these bytes to /dev/lcd to display them.
+ *
+ * A glyph that is already in CGRAM keeps its code and is not uploaded again.
+ * Any other glyph replaces the least recently requested one that is not part
+ * of the same call, so more than 8 glyphs can be used over time. Text that
+ * shows a replaced glyph's code changes to the new glyph.
+ */
+struct lcd_glyphs {
+	__u32 count;
+	__u32 reserved;
+	struct lcd_glyph glyphs[LCD_GLYPH_SLOTS];
+	__u8 codes[LCD_GLYPH_SLOTS];
+};
+
+#define LCD_IOC_MAGIC 'l'
+
+/* Load glyphs into CGRAM, reusing the slots of glyphs already there */
+#define LCD_IOC_LOAD_GLYPHS _IOWR(LCD_IOC_MAGIC, 0, struct lcd_glyphs)
+
+#endif /* _LCD_UAPI_H */
@@ -13,6 +13,20 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/kstrtox.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/leds.h>
+#include <linux/led-class-multicolor.h>
+#include <linux/pwm.h>
+
+#include "../adc/adc_api.h"
+#include "../fpga_stats.h"
+#include "pwm_uapi.h"
 
 
 
@@ -21,50 +35,1261 @@
 #define BLUE_DC_OFFSET 0x8
 #define PERIOD_OFFSET 0xC
 
-#define BYTE_SIZE 16
+#define BYTE_SIZE 16
+#define NUM_REGS (BYTE_SIZE / 4)
+
+#define ANIM_DEFAULT_TICK_US 1000	// Animation update interval if none is given
+#define ANIM_MIN_TICK_US 100		// Fastest animation update interval
+#define ANIM_MAX_TICK_US 1000000	// Slowest animation update interval
+#define ANIM_FRAC_BITS 16			// Fixed-point fraction bits of the interpolation
+
+#define DUTY_CYCLE_MAX 0x800		// 100% duty cycle in u12.11 fixed point
+#define DUTY_CYCLE_REG_MASK 0xFFF	// The duty cycle registers are 12 bits wide
+#define PERIOD_ONE_MS 0x800			// 1 ms period in u17.11 fixed point
+#define PERIOD_REG_MASK 0xFFFFFFF	// The period register is 28 bits wide
+
+#define BRIDGE_MAX_RATE 10000		// Fastest bridge update rate in Hz
+#define BRIDGE_HUE_MASK 0xFFF		// One full turn of hue per 12-bit ADC range
+#define BRIDGE_GREEN_HUE 1365		// Hue of green relative to red, 1/3 turn
+#define BRIDGE_BLUE_HUE 2731		// Hue of blue relative to red, 2/3 turn
+#define BRIDGE_LUT_SHIFT 4			// Hue bits below the resolution of the hue table
+
+/**
+ * CIE_LUT() - Default lookup table entry for a 10-bit linear intensity.
+ * @i: Input intensity, 0 to PWM_LUT_SIZE - 1.
+ *
+ * Treats the input as CIE 1976 lightness L* = 100 * i / 1023 and returns the
+ * matching relative luminance Y as a duty cycle, so equal input steps look
+ * like equal brightness steps:
+ *
+ *   Y = L* / 903.3              for L* <= 8
+ *   Y = ((L* + 16) / 116)^3     otherwise
+ *
+ * Everything is integer arithmetic on constants, so the compiler evaluates
+ * the whole table; the cube fits in 64 bits for the largest input.
+ */
+#define CIE_LUT(i) \
+	((u16)(((i) * 100 <= 8 * 1023) \
+		? (DUTY_CYCLE_MAX * 1000ULL * (i) + 1023ULL * 9033 / 2) / (1023ULL * 9033) \
+		: (DUTY_CYCLE_MAX * ((i) * 100ULL + 16 * 1023) * ((i) * 100ULL + 16 * 1023) \
+		   * ((i) * 100ULL + 16 * 1023) + (116ULL * 1023) * (116 * 1023) * (116 * 1023) / 2) \
+		  / ((116ULL * 1023) * (116 * 1023) * (116 * 1023))))
+
+#define CIE_LUT4(i) CIE_LUT(i), CIE_LUT((i) + 1), CIE_LUT((i) + 2), CIE_LUT((i) + 3)
+#define CIE_LUT16(i) CIE_LUT4(i), CIE_LUT4((i) + 4), CIE_LUT4((i) + 8), CIE_LUT4((i) + 12)
+#define CIE_LUT64(i) CIE_LUT16(i), CIE_LUT16((i) + 16), CIE_LUT16((i) + 32), CIE_LUT16((i) + 48)
+#define CIE_LUT256(i) CIE_LUT64(i), CIE_LUT64((i) + 64), CIE_LUT64((i) + 128), CIE_LUT64((i) + 192)
+
+static const u16 pwm_cie_lut[PWM_LUT_SIZE] =
+{
+	CIE_LUT256(0), CIE_LUT256(256), CIE_LUT256(512), CIE_LUT256(768),
+};
+
+/**
+ * Duty cycle of a colour channel over one turn of hue, 1024 * (1 + cos(x))
+ * for x = 2 * pi * i / 256, rounded. Same curve as the Taylor-series cos()
+ * the final project program evaluated per sample, without any floating point.
+ */
+static const u16 pwm_hue_lut[256] =
+{
+	2048, 2048, 2047, 2045, 2043, 2040, 2037, 2033, 2028, 2023, 2017, 2011, 2004, 1996, 1988, 1979,
+	1970, 1960, 1950, 1939, 1927, 1915, 1902, 1889, 1875, 1861, 1846, 1831, 1816, 1799, 1783, 1766,
+	1748, 1730, 1712, 1693, 1674, 1654, 1634, 1614, 1593, 1572, 1550, 1529, 1507, 1484, 1462, 1439,
+	1416, 1393, 1369, 1345, 1321, 1297, 1273, 1248, 1224, 1199, 1174, 1149, 1124, 1099, 1074, 1049,
+	1024, 999, 974, 949, 924, 899, 874, 849, 824, 800, 775, 751, 727, 703, 679, 655,
+	632, 609, 586, 564, 541, 519, 498, 476, 455, 434, 414, 394, 374, 355, 336, 318,
+	300, 282, 265, 249, 232, 217, 202, 187, 173, 159, 146, 133, 121, 109, 98, 88,
+	78, 69, 60, 52, 44, 37, 31, 25, 20, 15, 11, 8, 5, 3, 1, 0,
+	0, 0, 1, 3, 5, 8, 11, 15, 20, 25, 31, 37, 44, 52, 60, 69,
+	78, 88, 98, 109, 121, 133, 146, 159, 173, 187, 202, 217, 232, 249, 265, 282,
+	300, 318, 336, 355, 374, 394, 414, 434, 455, 476, 498, 519, 541, 564, 586, 609,
+	632, 655, 679, 703, 727, 751, 775, 800, 824, 849, 874, 899, 924, 949, 974, 999,
+	1024, 1049, 1074, 1099, 1124, 1149, 1174, 1199, 1224, 1248, 1273, 1297, 1321, 1345, 1369, 1393,
+	1416, 1439, 1462, 1484, 1507, 1529, 1550, 1572, 1593, 1614, 1634, 1654, 1674, 1693, 1712, 1730,
+	1748, 1766, 1783, 1799, 1816, 1831, 1846, 1861, 1875, 1889, 1902, 1915, 1927, 1939, 1950, 1960,
+	1970, 1979, 1988, 1996, 2004, 2011, 2017, 2023, 2028, 2033, 2037, 2040, 2043, 2045, 2047, 2048,
+};
+
+
+/**
+ * Define the compatible property used for matching devices to this driver,
+ * then add out device id structure to the kernel's device table. For a device
+ * to be matched with this driver, its device tree node must use the same
+ * compatible string as defined here.
+ */
+static const struct of_device_id pwm_of_match[] =
+{
+	{.compatible = "dupuis,pwm",},
+	{}
+};
+
+/**
+ * enum pwm_anim_status - State of the animation engine.
+ * @PWM_ANIM_STOPPED: No animation, or it was stopped before its end
+ * @PWM_ANIM_RUNNING: The animation timer is running
+ * @PWM_ANIM_DONE:    A one-shot animation reached its last keyframe
+ */
+enum pwm_anim_status
+{
+	PWM_ANIM_STOPPED,
+	PWM_ANIM_RUNNING,
+	PWM_ANIM_DONE,
+};
+
+/**
+ * struct pwm_anim_engine - Keyframe animation state.
+ * @timer:     hrtimer that steps the animation every @tick
+ * @tick:      Update interval
+ * @start:     Time the animation started
+ * @frames:    Keyframes of the animation, owned by the engine
+ * @count:     Number of entries in @frames
+ * @loop:      Restart after the last keyframe instead of stopping
+ * @length_us: Time of the last keyframe in microseconds
+ * @status:    One of the pwm_anim_status states
+ * @keyframe:  Index of the keyframe the current segment starts from
+ * @loops:     Number of completed loops
+ */
+struct pwm_anim_engine
+{
+	struct hrtimer timer;
+	ktime_t tick;
+	ktime_t start;
+	struct pwm_keyframe *frames;
+	unsigned int count;
+	bool loop;
+	u64 length_us;
+	enum pwm_anim_status status;
+	unsigned int keyframe;
+	unsigned long loops;
+};
+
+/**
+ * struct pwm_bridge - ADC-to-hue bridge state.
+ * @timer:   hrtimer that updates the colour every @period
+ * @period:  Update interval
+ * @read:    de10nano_adc_read(), looked up while the bridge runs
+ * @rate:    Update rate in Hz; 0 while the bridge is stopped
+ * @channel: ADC channel that sets the hue
+ * @offset:  Hue added to the ADC value, 0 to BRIDGE_HUE_MASK
+ * @errors:  Number of updates skipped because the ADC couldn't be read
+ */
+struct pwm_bridge
+{
+	struct hrtimer timer;
+	ktime_t period;
+	int (*read)(unsigned int channel, u16 *value);
+	unsigned int rate;
+	unsigned int channel;
+	unsigned int offset;
+	unsigned long errors;
+};
+
+/**
+ * struct pwm_dev - Private pwm device struct.
+ * @base_addr:        Pointer to the component's base address
+ * @red_duty_cycle:   Address of the red_duty_cycle register
+ * @green_duty_cycle: Address of the green_duty_cycle register
+ * @blue_duty_cycle:  Address of the blue_duty_cycle register
+ * @period:           Address of the period register
+ * @phys_addr:        Physical base address of the register window
+ * @span:             Size of the register window in bytes
+ * @miscdev:          miscdevice used to create a character device
+ * @lock:             mutex that serializes control of the animation engine
+ * @reg_lock:         spinlock that serializes register accesses; the
+ *                    animation timer takes it in softirq context
+ * @stats:            Latency and throughput counters, exposed in debugfs
+ * @anim:             Keyframe animation engine
+ * @bridge:           ADC-to-hue bridge
+ * @lut:              Lookup table of each channel, guarded by @reg_lock
+ * @lut_enable:       Map duty cycles through @lut before writing them
+ * @lut_input_bits:   Width of the linear input intensities, 8 or 10
+ * @shadow:           Last value written to each register, guarded by @reg_lock
+ * @shadow_valid:     Bit n is set if @shadow[n] matches the hardware
+ * @dirty:            Bit n is set if @shadow[n] still has to be written
+ * @mappings:         Number of userspace mappings of the register window;
+ *                    while there are any, the shadow can't be trusted
+ * @writes_skipped:   Number of register writes that the shadow made redundant
+ * @led:              Multicolor LED class device of the RGB LED
+ * @subled:           Red, green, and blue channels of @led
+ * @chip:             PWM chip exposing the three channels to kernel consumers
+ *
+ * pwm_dev struct gets created for each pwm component.
+ */
+struct pwm_dev
+{
+	void __iomem *base_addr;
+	void __iomem *red_duty_cycle;
+	void __iomem *green_duty_cycle;
+	void __iomem *blue_duty_cycle;
+	void __iomem *period;
+	phys_addr_t phys_addr;
+	resource_size_t span;
+	struct miscdevice miscdev;
+	struct mutex lock;
+	spinlock_t reg_lock;
+	struct fpga_stats stats;
+	struct pwm_anim_engine anim;
+	struct pwm_bridge bridge;
+	u16 lut[PWM_NUM_CHANNELS][PWM_LUT_SIZE];
+	bool lut_enable;
+	unsigned int lut_input_bits;
+	u32 shadow[NUM_REGS];
+	unsigned long shadow_valid;
+	unsigned long dirty;
+	atomic_t mappings;
+	unsigned long writes_skipped;
+	struct led_classdev_mc led;
+	struct mc_subled subled[PWM_NUM_CHANNELS];
+	struct pwm_chip chip;
+};
+
+
+
+// SHADOW REGISTERS -----------------------------------------------------------
+
+/**
+ * pwm_reg_stage() - Stage a register write in the shadow.
+ * @priv: The pwm device; the caller holds @priv->reg_lock.
+ * @reg:  Register index, the byte offset divided by 4.
+ * @val:  Value to write.
+ *
+ * The write is dropped if the register already holds @val. Otherwise the
+ * register is marked dirty and written by the next pwm_reg_flush(), so a
+ * batch of staged writes costs one bus transaction per changed register.
+ */
+static void pwm_reg_stage(struct pwm_dev *priv, unsigned int reg, u32 val)
+{
+	if ((priv->shadow_valid & BIT(reg)) && priv->shadow[reg] == val
+		&& !atomic_read(&priv->mappings))
+	{
+		priv->writes_skipped++;
+		return;
+	}
+	
+	priv->shadow[reg] = val;
+	priv->shadow_valid |= BIT(reg);
+	priv->dirty |= BIT(reg);
+}
+
+/**
+ * pwm_reg_flush() - Write every dirty register to the hardware.
+ * @priv: The pwm device; the caller holds @priv->reg_lock.
+ */
+static void pwm_reg_flush(struct pwm_dev *priv)
+{
+	unsigned int reg;
+	
+	for_each_set_bit(reg, &priv->dirty, NUM_REGS)
+	{
+		fpga_stats_iowrite32(&priv->stats, priv->shadow[reg], priv->base_addr + reg * sizeof(u32));
+	}
+	priv->dirty = 0;
+}
+
+/**
+ * pwm_reg_read() - Read a register, from the shadow when it can be trusted.
+ * @priv: The pwm device; the caller holds @priv->reg_lock.
+ * @reg:  Register index, the byte offset divided by 4.
+ *
+ * The hardware never changes the pwm registers by itself, so the shadow is
+ * exact unless userspace has the register window mapped.
+ *
+ * Return: The register value.
+ */
+static u32 pwm_reg_read(struct pwm_dev *priv, unsigned int reg)
+{
+	if ((priv->shadow_valid & BIT(reg)) && !atomic_read(&priv->mappings))
+	{
+		return priv->shadow[reg];
+	}
+	
+	priv->shadow[reg] = fpga_stats_ioread32(&priv->stats, priv->base_addr + reg * sizeof(u32));
+	if (!atomic_read(&priv->mappings))
+	{
+		priv->shadow_valid |= BIT(reg);
+	}
+	return priv->shadow[reg];
+}
+
+// END OF SHADOW REGISTERS ----------------------------------------------------
+
+
+
+// LOOKUP TABLES --------------------------------------------------------------
+
+/**
+ * pwm_lut_map() - Map a channel's input intensity to its register value.
+ * @priv: The pwm device; the caller holds @priv->reg_lock.
+ * @ch:   The PWM_CHANNEL_* the value is for.
+ * @val:  Input intensity, or a raw register value if the tables are off.
+ *
+ * Return: The value to write to the channel's duty cycle register.
+ */
+static u32 pwm_lut_map(struct pwm_dev *priv, unsigned int ch, u32 val)
+{
+	u32 max = BIT(priv->lut_input_bits) - 1;
+	
+	if (!priv->lut_enable)
+	{
+		return val;
+	}
+	
+	val = min(val, max);
+	return priv->lut[ch][val * (PWM_LUT_SIZE - 1) / max];
+}
+
+/**
+ * pwm_write_rgb() - Write the three duty cycle registers where they changed.
+ * @priv:  The pwm device; the caller holds @priv->reg_lock.
+ * @red:   Red input intensity or register value.
+ * @green: Green input intensity or register value.
+ * @blue:  Blue input intensity or register value.
+ */
+static void pwm_write_rgb(struct pwm_dev *priv, u32 red, u32 green, u32 blue)
+{
+	pwm_reg_stage(priv, PWM_CHANNEL_RED, pwm_lut_map(priv, PWM_CHANNEL_RED, red));
+	pwm_reg_stage(priv, PWM_CHANNEL_GREEN, pwm_lut_map(priv, PWM_CHANNEL_GREEN, green));
+	pwm_reg_stage(priv, PWM_CHANNEL_BLUE, pwm_lut_map(priv, PWM_CHANNEL_BLUE, blue));
+	pwm_reg_flush(priv);
+}
+
+/**
+ * pwm_input_scale() - Scale a linear value to the current input format.
+ * @priv: The pwm device; the caller holds @priv->reg_lock.
+ * @val:  Linear value, 0 to @max.
+ * @max:  Full scale of @val.
+ *
+ * With the lookup tables on, @val becomes a linear intensity of
+ * lut_input_bits bits, so it gets the same perceptual curve as everything
+ * else. Otherwise it is scaled straight to the register format.
+ *
+ * Return: The value to pass to pwm_write_rgb().
+ */
+static u32 pwm_input_scale(struct pwm_dev *priv, u32 val, u32 max)
+{
+	if (priv->lut_enable)
+	{
+		return val * (BIT(priv->lut_input_bits) - 1) / max;
+	}
+	
+	return val * DUTY_CYCLE_MAX / max;
+}
+
+/**
+ * pwm_lut_reset() - Load the default CIE lightness table on every channel.
+ * @priv: The pwm device; the caller holds @priv->reg_lock, or the device
+ *        isn't registered yet.
+ */
+static void pwm_lut_reset(struct pwm_dev *priv)
+{
+	unsigned int ch;
+	
+	for (ch = 0; ch < PWM_NUM_CHANNELS; ch++)
+	{
+		memcpy(priv->lut[ch], pwm_cie_lut, sizeof(pwm_cie_lut));
+	}
+}
+
+// END OF LOOKUP TABLES -------------------------------------------------------
+
+
+
+// BRIDGE ---------------------------------------------------------------------
+
+/**
+ * pwm_bridge_hue() - Look up the duty cycle of a channel at a hue.
+ * @hue: Hue of the channel, taken modulo BRIDGE_HUE_MASK + 1.
+ *
+ * Interpolates linearly between the entries of pwm_hue_lut.
+ *
+ * Return: The duty cycle, 0 to DUTY_CYCLE_MAX.
+ */
+static u32 pwm_bridge_hue(u32 hue)
+{
+	unsigned int i = (hue & BRIDGE_HUE_MASK) >> BRIDGE_LUT_SHIFT;
+	u32 frac = hue & (BIT(BRIDGE_LUT_SHIFT) - 1);
+	s32 from = pwm_hue_lut[i];
+	s32 to = pwm_hue_lut[(i + 1) % ARRAY_SIZE(pwm_hue_lut)];
+	
+	return from + (((to - from) * (s32)frac) >> BRIDGE_LUT_SHIFT);
+}
+
+/**
+ * pwm_bridge_fn() - Read the ADC and set the colour from it.
+ * @timer: The bridge's hrtimer.
+ *
+ * Runs in softirq context every period. The ADC value plus the hue offset is
+ * the hue of red; green and blue trail it by a third and two thirds of a
+ * turn, so one sweep of the ADC range goes once around the colour wheel.
+ *
+ * Return: HRTIMER_RESTART.
+ */
+static enum hrtimer_restart pwm_bridge_fn(struct hrtimer *timer)
+{
+	struct pwm_dev *priv = container_of(timer, struct pwm_dev, bridge.timer);
+	struct pwm_bridge *bridge = &priv->bridge;
+	u16 val;
+	u32 hue;
+	
+	if (bridge->read(READ_ONCE(bridge->channel), &val))
+	{
+		bridge->errors++;
+	}
+	else
+	{
+		hue = val + READ_ONCE(bridge->offset);
+		
+		fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+		pwm_write_rgb(priv, pwm_input_scale(priv, pwm_bridge_hue(hue), DUTY_CYCLE_MAX),
+			pwm_input_scale(priv, pwm_bridge_hue(hue - BRIDGE_GREEN_HUE), DUTY_CYCLE_MAX),
+			pwm_input_scale(priv, pwm_bridge_hue(hue - BRIDGE_BLUE_HUE), DUTY_CYCLE_MAX));
+		spin_unlock_bh(&priv->reg_lock);
+	}
+	
+	hrtimer_forward_now(timer, bridge->period);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * pwm_bridge_stop() - Stop the bridge and drop the adc module.
+ * @priv: The pwm device; the caller holds @priv->lock.
+ */
+static void pwm_bridge_stop(struct pwm_dev *priv)
+{
+	hrtimer_cancel(&priv->bridge.timer);
+	if (priv->bridge.read)
+	{
+		symbol_put(de10nano_adc_read);
+		priv->bridge.read = NULL;
+	}
+	WRITE_ONCE(priv->bridge.rate, 0);
+}
+
+/**
+ * pwm_bridge_start() - Start the bridge, or change its rate.
+ * @priv: The pwm device; the caller holds @priv->lock.
+ * @rate: Update rate in Hz, 1 to BRIDGE_MAX_RATE.
+ *
+ * The caller stops a running animation first. The adc module is looked up
+ * here rather than linked against, so the pwm driver still loads without it,
+ * and it can't be unloaded under the bridge.
+ *
+ * Return: 0 on success, or -ENODEV if the adc module isn't loaded.
+ */
+static int pwm_bridge_start(struct pwm_dev *priv, unsigned int rate)
+{
+	struct pwm_bridge *bridge = &priv->bridge;
+	
+	if (!bridge->read)
+	{
+		bridge->read = symbol_get(de10nano_adc_read);
+		if (!bridge->read)
+		{
+			return -ENODEV;
+		}
+	}
+	
+	hrtimer_cancel(&bridge->timer);
+	bridge->period = ns_to_ktime(div_u64(NSEC_PER_SEC, rate));
+	WRITE_ONCE(bridge->rate, rate);
+	hrtimer_start(&bridge->timer, 0, HRTIMER_MODE_REL_SOFT);
+	
+	return 0;
+}
+
+/**
+ * pwm_bridge_release() - devm action that stops the bridge.
+ * @data: The pwm device.
+ */
+static void pwm_bridge_release(void *data)
+{
+	struct pwm_dev *priv = data;
+	
+	mutex_lock(&priv->lock);
+	pwm_bridge_stop(priv);
+	mutex_unlock(&priv->lock);
+}
+
+// END OF BRIDGE --------------------------------------------------------------
+
+
+
+// ANIMATION ------------------------------------------------------------------
+
+/**
+ * pwm_anim_ease() - Apply an easing curve to the progress through a segment.
+ * @easing:   One of the PWM_EASE_* curves.
+ * @progress: Progress through the segment, 0 to 1 in ANIM_FRAC_BITS fixed point.
+ *
+ * Return: The eased progress, 0 to 1 in ANIM_FRAC_BITS fixed point.
+ */
+static u32 pwm_anim_ease(u32 easing, u32 progress)
+{
+	const u64 one = 1 << ANIM_FRAC_BITS;
+	u64 p = progress;
+	
+	switch (easing)
+	{
+	case PWM_EASE_STEP:
+		return 0;
+	case PWM_EASE_IN:
+		return (p * p) >> ANIM_FRAC_BITS;
+	case PWM_EASE_OUT:
+		return (p * (2 * one - p)) >> ANIM_FRAC_BITS;
+	case PWM_EASE_IN_OUT:
+		// Smoothstep: p^2 * (3 - 2p)
+		return (((p * p) >> ANIM_FRAC_BITS) * (3 * one - 2 * p)) >> ANIM_FRAC_BITS;
+	default:
+		return p;
+	}
+}
+
+/**
+ * pwm_anim_lerp() - Interpolate between two register values.
+ * @from:  Value at the start of the segment.
+ * @to:    Value at the end of the segment.
+ * @eased: Eased progress, 0 to 1 in ANIM_FRAC_BITS fixed point.
+ *
+ * Return: The interpolated value.
+ */
+static u32 pwm_anim_lerp(u32 from, u32 to, u32 eased)
+{
+	return from + (s32)((((s64)to - from) * eased) >> ANIM_FRAC_BITS);
+}
+
+/**
+ * pwm_anim_fn() - Step the animation and write the interpolated colour.
+ * @timer: The animation engine's hrtimer.
+ *
+ * Runs in softirq context every tick. The position in the animation comes
+ * from the time since it started rather than from counting ticks, so late
+ * ticks never make it drift.
+ *
+ * Return: HRTIMER_RESTART while the animation runs, HRTIMER_NORESTART once a
+ * one-shot animation has written its last keyframe.
+ */
+static enum hrtimer_restart pwm_anim_fn(struct hrtimer *timer)
+{
+	struct pwm_dev *priv = container_of(timer, struct pwm_dev, anim.timer);
+	struct pwm_anim_engine *anim = &priv->anim;
+	const struct pwm_keyframe *from;
+	const struct pwm_keyframe *to;
+	u64 t = ktime_us_delta(ktime_get(), anim->start);
+	u64 from_us, to_us;
+	u32 eased = 0;
+	bool done = false;
+	unsigned int i;
+	
+	if (anim->loop)
+	{
+		anim->loops = div64_u64_rem(t, anim->length_us, &t);
+	}
+	else if (t >= anim->length_us)
+	{
+		t = anim->length_us;
+		done = true;
+	}
+	
+	// Find the first keyframe after t; the segment runs into it.
+	for (i = 0; i < anim->count && (u64)anim->frames[i].time_ms * USEC_PER_MSEC <= t; i++)
+	{
+	}
+	
+	if (i == 0 || i == anim->count)
+	{
+		// Before the first or after the last keyframe: hold it.
+		from = &anim->frames[i ? i - 1 : 0];
+		to = from;
+	}
+	else
+	{
+		from = &anim->frames[i - 1];
+		to = &anim->frames[i];
+		from_us = (u64)from->time_ms * USEC_PER_MSEC;
+		to_us = (u64)to->time_ms * USEC_PER_MSEC;
+		eased = pwm_anim_ease(to->easing,
+			div64_u64((t - from_us) << ANIM_FRAC_BITS, to_us - from_us));
+	}
+	anim->keyframe = from - anim->frames;
+	
+	fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+	pwm_write_rgb(priv, pwm_anim_lerp(from->red, to->red, eased),
+		pwm_anim_lerp(from->green, to->green, eased),
+		pwm_anim_lerp(from->blue, to->blue, eased));
+	spin_unlock_bh(&priv->reg_lock);
+	
+	if (done)
+	{
+		WRITE_ONCE(anim->status, PWM_ANIM_DONE);
+		return HRTIMER_NORESTART;
+	}
+	
+	hrtimer_forward_now(timer, anim->tick);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * pwm_anim_stop() - Stop the running animation.
+ * @priv: The pwm device; the caller holds @priv->lock.
+ *
+ * The LED keeps the last colour the animation wrote.
+ */
+static void pwm_anim_stop(struct pwm_dev *priv)
+{
+	hrtimer_cancel(&priv->anim.timer);
+	if (priv->anim.status == PWM_ANIM_RUNNING)
+	{
+		WRITE_ONCE(priv->anim.status, PWM_ANIM_STOPPED);
+	}
+}
+
+/**
+ * pwm_anim_start() - Validate an animation and start it.
+ * @priv: The pwm device; the caller holds @priv->lock.
+ * @req:  The animation uploaded by userspace.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int pwm_anim_start(struct pwm_dev *priv, const struct pwm_anim *req)
+{
+	struct pwm_anim_engine *anim = &priv->anim;
+	struct pwm_keyframe *frames;
+	u32 tick_us = req->tick_us ? req->tick_us : ANIM_DEFAULT_TICK_US;
+	unsigned int i;
+	
+	if (req->count == 0 || req->count > PWM_ANIM_MAX_KEYFRAMES
+		|| (req->flags & ~PWM_ANIM_LOOP) || req->reserved
+		|| tick_us < ANIM_MIN_TICK_US || tick_us > ANIM_MAX_TICK_US)
+	{
+		return -EINVAL;
+	}
+	for (i = 0; i < req->count; i++)
+	{
+		if (req->frames[i].easing > PWM_EASE_IN_OUT
+			|| (i > 0 && req->frames[i].time_ms < req->frames[i - 1].time_ms))
+		{
+			return -EINVAL;
+		}
+	}
+	if ((req->flags & PWM_ANIM_LOOP) && req->frames[req->count - 1].time_ms == 0)
+	{
+		return -EINVAL;
+	}
+	
+	frames = kmemdup(req->frames, req->count * sizeof(*frames), GFP_KERNEL);
+	if (!frames)
+	{
+		return -ENOMEM;
+	}
+	
+	pwm_anim_stop(priv);
+	pwm_bridge_stop(priv);
+	kfree(anim->frames);
+	
+	anim->frames = frames;
+	anim->count = req->count;
+	anim->loop = req->flags & PWM_ANIM_LOOP;
+	anim->length_us = (u64)frames[req->count - 1].time_ms * USEC_PER_MSEC;
+	anim->tick = us_to_ktime(tick_us);
+	anim->keyframe = 0;
+	anim->loops = 0;
+	anim->status = PWM_ANIM_RUNNING;
+	anim->start = ktime_get();
+	hrtimer_start(&anim->timer, 0, HRTIMER_MODE_REL_SOFT);
+	
+	return 0;
+}
+
+/**
+ * pwm_sources_stop() - Stop everything that sets the colour by itself.
+ * @priv: The pwm device; the caller holds @priv->lock.
+ *
+ * Called before a direct colour change, so the change isn't overwritten on
+ * the next animation or bridge tick.
+ */
+static void pwm_sources_stop(struct pwm_dev *priv)
+{
+	pwm_anim_stop(priv);
+	pwm_bridge_stop(priv);
+}
+
+/**
+ * pwm_anim_release() - devm action that stops the animation and frees it.
+ * @data: The pwm device.
+ */
+static void pwm_anim_release(void *data)
+{
+	struct pwm_dev *priv = data;
+	
+	hrtimer_cancel(&priv->anim.timer);
+	kfree(priv->anim.frames);
+}
+
+// END OF ANIMATION -----------------------------------------------------------
+
+
+
+// LED AND PWM FRAMEWORKS -----------------------------------------------------
+
+/**
+ * pwm_led_brightness_set() - brightness_set_blocking method of the LED.
+ * @cdev:       The LED class device embedded in the pwm device.
+ * @brightness: Overall brightness, 0 to LED_FULL.
+ *
+ * The LED core splits @brightness across the channels by multi_intensity.
+ * Like any other direct colour change, this stops a running animation or
+ * bridge, which takes the mutex, so the LED core calls this from a workqueue
+ * when a trigger fires in atomic context.
+ *
+ * Return: 0.
+ */
+static int pwm_led_brightness_set(struct led_classdev *cdev,
+	enum led_brightness brightness)
+{
+	struct led_classdev_mc *mc = lcdev_to_mccdev(cdev);
+	struct pwm_dev *priv = container_of(mc, struct pwm_dev, led);
+	
+	led_mc_calc_color_components(mc, brightness);
+	
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	pwm_sources_stop(priv);
+	fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+	pwm_write_rgb(priv, pwm_input_scale(priv, priv->subled[PWM_CHANNEL_RED].brightness, LED_FULL),
+		pwm_input_scale(priv, priv->subled[PWM_CHANNEL_GREEN].brightness, LED_FULL),
+		pwm_input_scale(priv, priv->subled[PWM_CHANNEL_BLUE].brightness, LED_FULL));
+	spin_unlock_bh(&priv->reg_lock);
+	mutex_unlock(&priv->lock);
+	
+	return 0;
+}
+
+/**
+ * pwm_led_register() - Register the RGB LED with the multicolor LED class.
+ * @priv: The pwm device.
+ * @dev:  The platform device's struct device.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int pwm_led_register(struct pwm_dev *priv, struct device *dev)
+{
+	static const int colors[PWM_NUM_CHANNELS] =
+	{
+		[PWM_CHANNEL_RED] = LED_COLOR_ID_RED,
+		[PWM_CHANNEL_GREEN] = LED_COLOR_ID_GREEN,
+		[PWM_CHANNEL_BLUE] = LED_COLOR_ID_BLUE,
+	};
+	unsigned int ch;
+	
+	for (ch = 0; ch < PWM_NUM_CHANNELS; ch++)
+	{
+		priv->subled[ch].color_index = colors[ch];
+		priv->subled[ch].channel = ch;
+		priv->subled[ch].intensity = LED_FULL;
+	}
+	
+	priv->led.subled_info = priv->subled;
+	priv->led.num_colors = PWM_NUM_CHANNELS;
+	priv->led.led_cdev.name = "de10nano:rgb:" LED_FUNCTION_INDICATOR;
+	priv->led.led_cdev.max_brightness = LED_FULL;
+	priv->led.led_cdev.brightness_set_blocking = pwm_led_brightness_set;
+	
+	return devm_led_classdev_multicolor_register(dev, &priv->led);
+}
+
+/**
+ * pwm_chip_apply() - apply method of the pwm chip.
+ * @chip:  The pwm chip embedded in the pwm device.
+ * @pwm:   The channel; hwpwm is its PWM_CHANNEL_*.
+ * @state: The requested period, duty cycle, and polarity in ns.
+ *
+ * The three channels share one period register. A channel can only change
+ * the period while no other channel is enabled; otherwise the request must
+ * match the current period.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int pwm_chip_apply(struct pwm_chip *chip, struct pwm_device *pwm,
+	const struct pwm_state *state)
+{
+	struct pwm_dev *priv = container_of(chip, struct pwm_dev, chip);
+	u64 period_ns = min_t(u64, state->period, div_u64((u64)PERIOD_REG_MASK * NSEC_PER_MSEC, PERIOD_ONE_MS));
+	u32 period = div_u64(period_ns * PERIOD_ONE_MS, NSEC_PER_MSEC);
+	u32 duty = 0;
+	unsigned int i;
+	int ret = 0;
+	
+	if (state->polarity != PWM_POLARITY_NORMAL)
+	{
+		return -EINVAL;
+	}
+	if (state->enabled && period == 0)
+	{
+		return -EINVAL;
+	}
+	if (state->enabled)
+	{
+		duty = div64_u64(min(state->duty_cycle, period_ns) * DUTY_CYCLE_MAX, period_ns);
+	}
+	
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	pwm_sources_stop(priv);
+	fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+	if (state->enabled && period != pwm_reg_read(priv, PERIOD_OFFSET / sizeof(u32)))
+	{
+		for (i = 0; i < chip->npwm; i++)
+		{
+			if (i != pwm->hwpwm && pwm_is_enabled(&chip->pwms[i]))
+			{
+				ret = -EBUSY;
+			}
+		}
+		if (!ret)
+		{
+			pwm_reg_stage(priv, PERIOD_OFFSET / sizeof(u32), period);
+		}
+	}
+	if (!ret)
+	{
+		// PWM consumers ask for exact duty cycles, so the lookup tables don't apply.
+		pwm_reg_stage(priv, pwm->hwpwm, duty);
+		pwm_reg_flush(priv);
+	}
+	spin_unlock_bh(&priv->reg_lock);
+	mutex_unlock(&priv->lock);
+	
+	return ret;
+}
+
+/**
+ * pwm_chip_get_state() - get_state method of the pwm chip.
+ * @chip:  The pwm chip embedded in the pwm device.
+ * @pwm:   The channel; hwpwm is its PWM_CHANNEL_*.
+ * @state: Filled in with the channel's current state.
+ *
+ * Rounds up, so applying the returned state writes the same registers.
+ *
+ * Return: 0.
+ */
+static int pwm_chip_get_state(struct pwm_chip *chip, struct pwm_device *pwm,
+	struct pwm_state *state)
+{
+	struct pwm_dev *priv = container_of(chip, struct pwm_dev, chip);
+	u32 duty;
+	u32 period;
+	
+	fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+	duty = pwm_reg_read(priv, pwm->hwpwm);
+	period = pwm_reg_read(priv, PERIOD_OFFSET / sizeof(u32));
+	spin_unlock_bh(&priv->reg_lock);
+	
+	state->period = DIV_ROUND_UP_ULL((u64)(period & PERIOD_REG_MASK) * NSEC_PER_MSEC, PERIOD_ONE_MS);
+	state->duty_cycle = DIV_ROUND_UP_ULL((u64)min_t(u32, duty, DUTY_CYCLE_MAX) * state->period, DUTY_CYCLE_MAX);
+	state->enabled = duty != 0;
+	state->polarity = PWM_POLARITY_NORMAL;
+	
+	return 0;
+}
+
+static const struct pwm_ops pwm_chip_ops =
+{
+	.apply = pwm_chip_apply,
+	.get_state = pwm_chip_get_state,
+};
+
+// END OF LED AND PWM FRAMEWORKS ----------------------------------------------
+
+
+
+// ATTRIBUTES -----------------------------------------------------------------
+
+/**
+ * anim_state_show() - Return the state of the animation engine.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t anim_state_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	static const char * const names[] =
+	{
+		[PWM_ANIM_STOPPED] = "stopped",
+		[PWM_ANIM_RUNNING] = "running",
+		[PWM_ANIM_DONE] = "done",
+	};
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%s\n", names[READ_ONCE(priv->anim.status)]);
+}
+
+/**
+ * anim_keyframe_show() - Return the keyframe the animation is leaving.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t anim_keyframe_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(priv->anim.keyframe));
+}
+
+/**
+ * anim_loops_show() - Return the number of loops a looping animation completed.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t anim_loops_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(priv->anim.loops));
+}
+
+
+/**
+ * lut_enable_show() - Return whether duty cycles go through the lookup tables.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t lut_enable_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(priv->lut_enable));
+}
+
+/**
+ * lut_enable_store() - Turn the lookup tables on or off.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that contains a boolean.
+ * @size: The number of bytes being written.
+ * 
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t lut_enable_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	bool enable;
+	int ret;
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	ret = kstrtobool(buf, &enable);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	
+	spin_lock_bh(&priv->reg_lock);
+	priv->lut_enable = enable;
+	spin_unlock_bh(&priv->reg_lock);
+	
+	return size;
+}
+
+/**
+ * lut_input_bits_show() - Return the width of the linear input intensities.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t lut_input_bits_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(priv->lut_input_bits));
+}
+
+/**
+ * lut_input_bits_store() - Set the width of the linear input intensities.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that contains 8 or 10.
+ * @size: The number of bytes being written.
+ * 
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t lut_input_bits_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int bits;
+	int ret;
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	ret = kstrtouint(buf, 0, &bits);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	if (bits != 8 && bits != 10)
+	{
+		return -EINVAL;
+	}
+	
+	spin_lock_bh(&priv->reg_lock);
+	priv->lut_input_bits = bits;
+	spin_unlock_bh(&priv->reg_lock);
+	
+	return size;
+}
 
 
 /**
- * Define the compatible property used for matching devices to this driver,
- * then add out device id structure to the kernel's device table. For a device
- * to be matched with this driver, its device tree node must use the same
- * compatible string as defined here.
+ * writes_skipped_show() - Return the number of redundant register writes saved.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
  */
-static const struct of_device_id pwm_of_match[] =
+static ssize_t writes_skipped_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
 {
-	{.compatible = "dupuis,pwm",},
-	{}
-};
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(priv->writes_skipped));
+}
+
 
 /**
- * struct pwm_dev - Private pwm device struct.
- * @base_addr:        Pointer to the component's base address
- * @red_duty_cycle:   Address of the red_duty_cycle register
- * @green_duty_cycle: Address of the green_duty_cycle register
- * @blue_duty_cycle:  Address of the blue_duty_cycle register
- * @period:           Address of the period register
- * @miscdev:          miscdevice used to create a character device
- * @lock:             mutex used to prevent concurrent writes to memory
- *
- * pwm_dev struct gets created for each pwm component.
+ * bridge_rate_show() - Return the update rate of the ADC-to-hue bridge.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
  */
-struct pwm_dev
+static ssize_t bridge_rate_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
 {
-	void __iomem *base_addr;
-	void __iomem *red_duty_cycle;
-	void __iomem *green_duty_cycle;
-	void __iomem *blue_duty_cycle;
-	void __iomem *period;
-	struct miscdevice miscdev;
-	struct mutex lock;
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(priv->bridge.rate));
+}
+
+/**
+ * bridge_rate_store() - Start, retime, or stop the ADC-to-hue bridge.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that contains the rate in Hz; 0 stops the bridge.
+ * @size: The number of bytes being written.
+ * 
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t bridge_rate_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int rate;
+	int ret;
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	ret = kstrtouint(buf, 0, &rate);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	if (rate > BRIDGE_MAX_RATE)
+	{
+		return -EINVAL;
+	}
+	
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	if (rate)
+	{
+		pwm_anim_stop(priv);
+		ret = pwm_bridge_start(priv, rate);
+	}
+	else
+	{
+		pwm_bridge_stop(priv);
+	}
+	mutex_unlock(&priv->lock);
+	
+	return ret ? ret : size;
+}
+
+/**
+ * bridge_channel_show() - Return the ADC channel that sets the hue.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t bridge_channel_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(priv->bridge.channel));
+}
+
+/**
+ * bridge_channel_store() - Select the ADC channel that sets the hue.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that contains the channel, 0 to 7.
+ * @size: The number of bytes being written.
+ * 
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t bridge_channel_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int channel;
+	int ret;
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	ret = kstrtouint(buf, 0, &channel);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	if (channel >= ADC_NUM_CHANNELS)
+	{
+		return -EINVAL;
+	}
+	
+	WRITE_ONCE(priv->bridge.channel, channel);
+	
+	return size;
+}
+
+/**
+ * bridge_offset_show() - Return the hue offset of the bridge.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t bridge_offset_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(priv->bridge.offset));
+}
+
+/**
+ * bridge_offset_store() - Set the hue offset of the bridge.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that contains the offset, 0 to 4095 (one full turn).
+ * @size: The number of bytes being written.
+ * 
+ * Return: The number of bytes stored, or a negative error value.
+ */
+static ssize_t bridge_offset_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t size)
+{
+	unsigned int offset;
+	int ret;
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	ret = kstrtouint(buf, 0, &offset);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	if (offset > BRIDGE_HUE_MASK)
+	{
+		return -EINVAL;
+	}
+	
+	WRITE_ONCE(priv->bridge.offset, offset);
+	
+	return size;
+}
+
+/**
+ * bridge_errors_show() - Return the number of bridge updates without an ADC value.
+ * @dev:  Device structure for the pwm component. This is embedded
+ *        in the pwm's platform device struct.
+ * @attr: Unused.
+ * @buf:  Buffer that gets returned to userspace.
+ * 
+ * Return: The number of bytes read.
+ */
+static ssize_t bridge_errors_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct pwm_dev *priv = dev_get_drvdata(dev);
+	
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(priv->bridge.errors));
+}
+
+
+
+// Define sysfs attributes
+static DEVICE_ATTR_RO(anim_state);
+static DEVICE_ATTR_RO(anim_keyframe);
+static DEVICE_ATTR_RO(anim_loops);
+static DEVICE_ATTR_RW(lut_enable);
+static DEVICE_ATTR_RW(lut_input_bits);
+static DEVICE_ATTR_RO(writes_skipped);
+static DEVICE_ATTR_RW(bridge_rate);
+static DEVICE_ATTR_RW(bridge_channel);
+static DEVICE_ATTR_RW(bridge_offset);
+static DEVICE_ATTR_RO(bridge_errors);
+
+// Create an attribute group so the device core can export attributes for us
+static struct attribute *pwm_attrs[] =
+{
+	&dev_attr_anim_state.attr,
+	&dev_attr_anim_keyframe.attr,
+	&dev_attr_anim_loops.attr,
+	&dev_attr_lut_enable.attr,
+	&dev_attr_lut_input_bits.attr,
+	&dev_attr_writes_skipped.attr,
+	&dev_attr_bridge_rate.attr,
+	&dev_attr_bridge_channel.attr,
+	&dev_attr_bridge_offset.attr,
+	&dev_attr_bridge_errors.attr,
+	NULL,
 };
+ATTRIBUTE_GROUPS(pwm);
+
+// END OF ATTRIBUTES ----------------------------------------------------------
 
 
 
 // FILE OPERATIONS ------------------------------------------------------------
 
 /**
- * pwm_read() - Read method for the pwm char device
+ * pwm_do_read() - Read method for the pwm char device
  * @file:   Pointer to the char device file struct.
  * @buf:    User-space buffer to read the value into.
  * @count:  The number of bytes being requested.
@@ -74,7 +1299,7 @@ struct pwm_dev
  * offset @offset is advanced by this number. On error, a negative error
  * value is returned.
  */
-static ssize_t pwm_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+static ssize_t pwm_do_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
 {
 	u32 val;
 	struct pwm_dev *priv = container_of(file->private_data, struct pwm_dev, miscdev);
@@ -94,7 +1319,9 @@ static ssize_t pwm_read(struct file *file, char __user *buf, size_t count, loff_
 		return -EFAULT;
 	}
 	
-	val = ioread32(priv->base_addr + *offset);
+	fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+	val = pwm_reg_read(priv, *offset / sizeof(u32));
+	spin_unlock_bh(&priv->reg_lock);
 	
 	// Copy the value to userspace.
 	bytes_copied = sizeof(val) - copy_to_user(buf, &val, sizeof(val));
@@ -113,19 +1340,25 @@ static ssize_t pwm_read(struct file *file, char __user *buf, size_t count, loff_
 
 
 /**
- * pwm_write() - Write method for the pwm char device
+ * pwm_do_write() - Write method for the pwm char device
  * @file:   Pointer to the char device file struct.
- * @buf:    User-space buffer to read the value from.
+ * @buf:    User-space buffer to read the values from.
  * @count:  The number of bytes being written.
  * @offset: The byte offset in the file being written to.
  *
+ * Writes every whole register from @offset up to @count bytes, all under one
+ * lock hold, so a 16-byte write at offset 0 (a struct pwm_rgb) updates the
+ * colour and period together instead of tearing between channels.
+ *
  * Return: On success, the number of bytes written is returned and the
  * offset @offset is advanced by this number. On error, a negative error
  * value is returned.
  */
-static ssize_t pwm_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
+static ssize_t pwm_do_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
 {
-	u32 val;
+	u32 vals[BYTE_SIZE / sizeof(u32)];
+	unsigned int reg;
+	unsigned int i;
 	
 	struct pwm_dev *priv = container_of(file->private_data, struct pwm_dev, miscdev);
 	
@@ -134,7 +1367,7 @@ static ssize_t pwm_write(struct file *file, const char __user *buf, size_t count
 	{
 		return -EINVAL;
 	}
-	if (*offset >= 16)
+	if (*offset >= BYTE_SIZE)
 	{
 		return 0;
 	}
@@ -144,33 +1377,272 @@ static ssize_t pwm_write(struct file *file, const char __user *buf, size_t count
 		return -EFAULT;
 	}
 	
-	mutex_lock(&priv->lock);
-	
-	// Get the value from userspace.
-	size_t ret = copy_from_user(&val, buf, sizeof(val));
-	if (ret != sizeof(val))
+	// Only whole registers are written, and never past the end of the device.
+	count = min_t(size_t, count, BYTE_SIZE - *offset) & ~(size_t)0x3;
+	if (count == 0)
 	{
-		iowrite32(val, priv->base_addr + *offset);
-		
-		// Increment the file offset by the number of bytes we wrote.
-		*offset = *offset + sizeof(val);
-		
-		// Return the number of bytes we wrote.
-		ret = sizeof(val);
+		return -EINVAL;
 	}
-	else
+	
+	// Get the values from userspace before taking the lock.
+	if (copy_from_user(vals, buf, count))
 	{
 		pr_warn("pwm_write: nothing copied from user space\n");
-		ret = -EFAULT;
+		return -EFAULT;
 	}
 	
+	fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+	pwm_sources_stop(priv);
+	fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+	for (i = 0; i < count / sizeof(u32); i++)
+	{
+		reg = *offset / sizeof(u32) + i;
+		if (reg < PWM_NUM_CHANNELS)
+		{
+			vals[i] = pwm_lut_map(priv, reg, vals[i]);
+		}
+		pwm_reg_stage(priv, reg, vals[i]);
+	}
+	pwm_reg_flush(priv);
+	spin_unlock_bh(&priv->reg_lock);
 	mutex_unlock(&priv->lock);
 	
+	// Increment the file offset by the number of bytes we wrote.
+	*offset = *offset + count;
+	
+	return count;
+}
+
+
+
+/**
+ * pwm_do_ioctl() - Ioctl method for the pwm char device
+ * @file: Pointer to the char device file struct.
+ * @cmd:  One of the PWM_IOC_* commands from pwm_uapi.h.
+ * @arg:  Pointer to a struct pwm_rgb in userspace.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static long pwm_do_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct pwm_dev *priv = container_of(file->private_data, struct pwm_dev, miscdev);
+	struct pwm_anim *anim;
+	struct pwm_lut *lut;
+	struct pwm_rgb rgb;
+	unsigned int i;
+	int ret;
+	
+	switch (cmd)
+	{
+	case PWM_IOC_SET:
+		if (copy_from_user(&rgb, (void __user *)arg, sizeof(rgb)))
+		{
+			return -EFAULT;
+		}
+		
+		fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+		pwm_sources_stop(priv);
+		fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+		if (rgb.period)
+		{
+			pwm_reg_stage(priv, PERIOD_OFFSET / sizeof(u32), rgb.period);
+		}
+		pwm_write_rgb(priv, rgb.red, rgb.green, rgb.blue);
+		spin_unlock_bh(&priv->reg_lock);
+		mutex_unlock(&priv->lock);
+		return 0;
+	case PWM_IOC_GET:
+		fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+		rgb.red = pwm_reg_read(priv, RED_DC_OFFSET / sizeof(u32));
+		rgb.green = pwm_reg_read(priv, GREEN_DC_OFFSET / sizeof(u32));
+		rgb.blue = pwm_reg_read(priv, BLUE_DC_OFFSET / sizeof(u32));
+		rgb.period = pwm_reg_read(priv, PERIOD_OFFSET / sizeof(u32));
+		spin_unlock_bh(&priv->reg_lock);
+		
+		if (copy_to_user((void __user *)arg, &rgb, sizeof(rgb)))
+		{
+			return -EFAULT;
+		}
+		return 0;
+	case PWM_IOC_ANIM_START:
+		anim = memdup_user((void __user *)arg, sizeof(*anim));
+		if (IS_ERR(anim))
+		{
+			return PTR_ERR(anim);
+		}
+		
+		fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+		ret = pwm_anim_start(priv, anim);
+		mutex_unlock(&priv->lock);
+		
+		kfree(anim);
+		return ret;
+	case PWM_IOC_ANIM_STOP:
+		fpga_stats_mutex_lock(&priv->stats, &priv->lock);
+		pwm_anim_stop(priv);
+		mutex_unlock(&priv->lock);
+		return 0;
+	case PWM_IOC_SET_LUT:
+		lut = memdup_user((void __user *)arg, sizeof(*lut));
+		if (IS_ERR(lut))
+		{
+			return PTR_ERR(lut);
+		}
+		
+		ret = 0;
+		if (lut->channel >= PWM_NUM_CHANNELS || lut->reserved)
+		{
+			ret = -EINVAL;
+		}
+		for (i = 0; i < PWM_LUT_SIZE && !ret; i++)
+		{
+			if (lut->table[i] > DUTY_CYCLE_REG_MASK)
+			{
+				ret = -EINVAL;
+			}
+		}
+		if (!ret)
+		{
+			fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+			memcpy(priv->lut[lut->channel], lut->table, sizeof(lut->table));
+			spin_unlock_bh(&priv->reg_lock);
+		}
+		
+		kfree(lut);
+		return ret;
+	case PWM_IOC_RESET_LUT:
+		fpga_stats_spin_lock_bh(&priv->stats, &priv->reg_lock);
+		pwm_lut_reset(priv);
+		spin_unlock_bh(&priv->reg_lock);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+
+
+/*
+ * The read, write, and ioctl entry points time the whole syscall into the
+ * device's stats.
+ */
+static ssize_t pwm_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+{
+	struct pwm_dev *priv = container_of(file->private_data, struct pwm_dev, miscdev);
+	u64 start = fpga_stats_start(&priv->stats);
+	ssize_t ret = pwm_do_read(file, buf, count, offset);
+	
+	fpga_stats_end(&priv->stats, FPGA_STAT_READ, start);
+	return ret;
+}
+
+static ssize_t pwm_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
+{
+	struct pwm_dev *priv = container_of(file->private_data, struct pwm_dev, miscdev);
+	u64 start = fpga_stats_start(&priv->stats);
+	ssize_t ret = pwm_do_write(file, buf, count, offset);
+	
+	fpga_stats_end(&priv->stats, FPGA_STAT_WRITE, start);
+	return ret;
+}
+
+static long pwm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct pwm_dev *priv = container_of(file->private_data, struct pwm_dev, miscdev);
+	u64 start = fpga_stats_start(&priv->stats);
+	long ret = pwm_do_ioctl(file, cmd, arg);
+	
+	fpga_stats_end(&priv->stats, FPGA_STAT_IOCTL, start);
 	return ret;
 }
 
 
 
+/**
+ * pwm_vma_open() - Count a new userspace mapping of the register window.
+ * @vma: The mapping, created by pwm_mmap() or copied by fork().
+ */
+static void pwm_vma_open(struct vm_area_struct *vma)
+{
+	struct pwm_dev *priv = vma->vm_private_data;
+	
+	atomic_inc(&priv->mappings);
+}
+
+/**
+ * pwm_vma_close() - Drop a userspace mapping of the register window.
+ * @vma: The mapping going away.
+ *
+ * Userspace may have changed any register through the mappings, so once the
+ * last one is gone the shadow is resynchronized from the hardware on the
+ * next access. Until then the shadow is bypassed anyway.
+ */
+static void pwm_vma_close(struct vm_area_struct *vma)
+{
+	struct pwm_dev *priv = vma->vm_private_data;
+	
+	spin_lock_bh(&priv->reg_lock);
+	if (atomic_dec_and_test(&priv->mappings))
+	{
+		priv->shadow_valid = 0;
+	}
+	spin_unlock_bh(&priv->reg_lock);
+}
+
+static const struct vm_operations_struct pwm_vm_ops =
+{
+	.open = pwm_vma_open,
+	.close = pwm_vma_close,
+};
+
+
+
+/**
+ * pwm_mmap() - Mmap method for the pwm char device
+ * @file: Pointer to the char device file struct.
+ * @vma:  Userspace mapping being set up.
+ *
+ * Maps the pwm register window into userspace, uncached. The window has to
+ * be page aligned and a whole number of pages long, or the mapping would
+ * hand out the neighbouring components on the lightweight bridge too; a
+ * 16-byte window on a shared page gets -EINVAL, and write() remains the way
+ * to set the colour.
+ *
+ * Return: 0 on success, or a negative error value.
+ */
+static int pwm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pwm_dev *priv = container_of(file->private_data, struct pwm_dev, miscdev);
+	int ret;
+	unsigned long pages = priv->span >> PAGE_SHIFT;
+	
+	if (!(vma->vm_flags & VM_SHARED) || !PAGE_ALIGNED(priv->phys_addr) ||
+		!PAGE_ALIGNED(priv->span))
+	{
+		return -EINVAL;
+	}
+	if (vma->vm_pgoff >= pages || vma_pages(vma) > pages - vma->vm_pgoff)
+	{
+		return -EINVAL;
+	}
+	
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	ret = vm_iomap_memory(vma, priv->phys_addr, priv->span);
+	if (ret)
+	{
+		return ret;
+	}
+	
+	// Bypass the shadow registers for as long as the mapping exists.
+	vma->vm_private_data = priv;
+	vma->vm_ops = &pwm_vm_ops;
+	pwm_vma_open(vma);
+	
+	return 0;
+}
+
+
+
 /**
  * pwm_fops - File operations supported by the pwm driver
  * @owner:  The pwm driver owns the file operations; this ensures
@@ -178,6 +1650,8 @@ static ssize_t pwm_write(struct file *file, const char __user *buf, size_t count
  *          still in use.
  * @read:   The read function.
  * @write:  The write function.
+ * @unlocked_ioctl: Atomic multi-register updates, see pwm_uapi.h.
+ * @mmap:   Maps the register window into userspace.
  * @llseek: We use the kernel's default_llseek() function; this allows users
  *          to change what position they are writing/reading to/from.
  */
@@ -186,6 +1660,8 @@ static const struct file_operations pwm_fops =
 	.owner = THIS_MODULE,
 	.read = pwm_read,
 	.write = pwm_write,
+	.unlocked_ioctl = pwm_ioctl,
+	.mmap = pwm_mmap,
 	.llseek = default_llseek,
 };
 
@@ -215,6 +1691,8 @@ static int pwm_probe(struct platform_device *pdev)
 	 * is automatically freed when the device is removed.
 	 */
 	struct pwm_dev *priv;
+	struct resource *res;
+	int err;
 	priv = devm_kzalloc(&pdev->dev, sizeof(struct pwm_dev), GFP_KERNEL);
 	if (!priv)
 	{
@@ -228,12 +1706,28 @@ static int pwm_probe(struct platform_device *pdev)
 	 * into the kernel's virtual address space because we don't have access
 	 * to physical memory locations.
 	 */
-	priv->base_addr = devm_platform_ioremap_resource(pdev, 0);
+	priv->base_addr = devm_platform_get_and_ioremap_resource(pdev, 0, &res);
 	if (IS_ERR(priv->base_addr))
 	{
 		pr_err("Failed to request/remap platform device resource.\n");
 		return PTR_ERR(priv->base_addr);
 	}
+	priv->phys_addr = res->start;
+	priv->span = resource_size(res);
+	
+	mutex_init(&priv->lock);
+	spin_lock_init(&priv->reg_lock);
+	
+	// The lookup tables start out with the CIE curve, but disabled.
+	pwm_lut_reset(priv);
+	priv->lut_input_bits = 10;
+	
+	err = fpga_stats_init(&pdev->dev, &priv->stats);
+	if (err)
+	{
+		pr_err("Failed to set up stats.\n");
+		return err;
+	}
 	
 	// Set the memory addresses for each register.
 	priv->red_duty_cycle = priv->base_addr + RED_DC_OFFSET;
@@ -242,10 +1736,50 @@ static int pwm_probe(struct platform_device *pdev)
 	priv->period = priv->base_addr + PERIOD_OFFSET;
 	
 	// Initialize registers to show pretty pink
-	iowrite32(0x00000800, priv->red_duty_cycle);	// Red duty cycle   = 1     = 1.0
-	iowrite32(0x00000020, priv->green_duty_cycle);	// Green duty cycle = 1/64  = 0.0156
-	iowrite32(0x00000010, priv->blue_duty_cycle);	// Blue duty cycle  = 1/128 = 0.0078
-	iowrite32(0x00002800, priv->period);			// Period = 5 ms
+	// The writes also seed the shadow registers.
+	spin_lock_bh(&priv->reg_lock);
+	pwm_reg_stage(priv, RED_DC_OFFSET / 4, 0x00000800);		// Red duty cycle   = 1     = 1.0
+	pwm_reg_stage(priv, GREEN_DC_OFFSET / 4, 0x00000020);	// Green duty cycle = 1/64  = 0.0156
+	pwm_reg_stage(priv, BLUE_DC_OFFSET / 4, 0x00000010);	// Blue duty cycle  = 1/128 = 0.0078
+	pwm_reg_stage(priv, PERIOD_OFFSET / 4, 0x00002800);		// Period = 5 ms
+	pwm_reg_flush(priv);
+	spin_unlock_bh(&priv->reg_lock);
+	
+	// Set up the animation engine; it stays idle until an animation is uploaded.
+	hrtimer_init(&priv->anim.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	priv->anim.timer.function = pwm_anim_fn;
+	if (devm_add_action_or_reset(&pdev->dev, pwm_anim_release, priv))
+	{
+		pr_err("Failed to set up the animation engine.\n");
+		return -ENOMEM;
+	}
+	
+	// Set up the ADC-to-hue bridge; it stays idle until bridge_rate is set.
+	hrtimer_init(&priv->bridge.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	priv->bridge.timer.function = pwm_bridge_fn;
+	if (devm_add_action_or_reset(&pdev->dev, pwm_bridge_release, priv))
+	{
+		pr_err("Failed to set up the bridge.\n");
+		return -ENOMEM;
+	}
+	
+	/**
+	 * Expose the LED to the LED class and the channels to the pwm framework.
+	 * Both are optional, so a kernel built without them still gets /dev/pwm.
+	 */
+	if (pwm_led_register(priv, &pdev->dev))
+	{
+		pr_warn("Failed to register the multicolor LED; is CONFIG_LEDS_CLASS_MULTICOLOR set?\n");
+	}
+#if IS_ENABLED(CONFIG_PWM)
+	priv->chip.dev = &pdev->dev;
+	priv->chip.ops = &pwm_chip_ops;
+	priv->chip.npwm = PWM_NUM_CHANNELS;
+	if (devm_pwmchip_add(&pdev->dev, &priv->chip))
+	{
+		pr_warn("Failed to register the pwm chip.\n");
+	}
+#endif
 	
 	// Initialize the misc device parameters
 	priv->miscdev.minor = MISC_DYNAMIC_MINOR;
@@ -304,6 +1838,7 @@ static int pwm_remove(struct platform_device *pdev)
  * @driver.owner:          Which module owns this driver
  * @driver.name:           Name of driver
  * @driver.of_match_table: Device tree match table
+ * @driver.dev_groups:     sysfs attribute groups of the device
  */
 static struct platform_driver pwm_driver = {
 	.probe = pwm_probe,
@@ -312,7 +1847,7 @@ static struct platform_driver pwm_driver = {
 		.owner = THIS_MODULE,
 		.name = "pwm",
 		.of_match_table = pwm_of_match,
-	//	.dev_groups = pwm_groups,
+		.dev_groups = pwm_groups,
 	},
 };
 
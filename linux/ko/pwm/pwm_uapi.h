@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: GPL-2.0 or MIT */
+/*
+ * Userspace interface for the pwm rgb led driver.
+ *
+ * This header is shared by the kernel module and by userspace programs that
+ * talk to /dev/pwm, so it only uses the exported linux/ types.
+ */
+#ifndef _PWM_UAPI_H
+#define _PWM_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Channels, in register order */
+#define PWM_CHANNEL_RED   0
+#define PWM_CHANNEL_GREEN 1
+#define PWM_CHANNEL_BLUE  2
+#define PWM_NUM_CHANNELS  3
+
+/* Entries of a lookup table; one per 10-bit input intensity */
+#define PWM_LUT_SIZE 1024
+
+/**
+ * struct pwm_rgb - All pwm registers, in register order.
+ * @red:    Red duty cycle, unsigned 12.11 fixed point (0x800 = 100%).
+ * @green:  Green duty cycle, unsigned 12.11 fixed point.
+ * @blue:   Blue duty cycle, unsigned 12.11 fixed point.
+ * @period: PWM period in ms, unsigned 17.11 fixed point. PWM_IOC_SET leaves
+ *          the period unchanged when this is 0.
+ *
+ * The layout matches the register window, so the same struct can also be
+ * passed to a single 16-byte write() at offset 0. Setting the colour through
+ * write() or PWM_IOC_SET stops a running animation.
+ *
+ * While the lut_enable sysfs attribute is set, duty cycles written through
+ * write(), PWM_IOC_SET, and animations are linear intensities of
+ * lut_input_bits bits instead, and each channel's lookup table turns them
+ * into register values. read() and PWM_IOC_GET always return the register
+ * values, so while the tables are on they return the looked-up duty cycles,
+ * not the intensities that were written.
+ */
+struct pwm_rgb {
+	__u32 red;
+	__u32 green;
+	__u32 blue;
+	__u32 period;
+};
+
+/*
+ * Easing curves of an animation segment, applied to the transition from the
+ * previous keyframe into the keyframe that carries the easing.
+ *
+ * PWM_EASE_STEP:        hold the previous colour, then jump at the keyframe.
+ * PWM_EASE_LINEAR:      constant rate.
+ * PWM_EASE_IN:          quadratic, starts slow.
+ * PWM_EASE_OUT:         quadratic, ends slow.
+ * PWM_EASE_IN_OUT:      smoothstep, slow at both ends.
+ */
+#define PWM_EASE_STEP    0
+#define PWM_EASE_LINEAR  1
+#define PWM_EASE_IN      2
+#define PWM_EASE_OUT     3
+#define PWM_EASE_IN_OUT  4
+
+#define PWM_ANIM_MAX_KEYFRAMES 64
+
+/* Restart from the first keyframe after the last one instead of holding it */
+#define PWM_ANIM_LOOP (1 << 0)
+
+/**
+ * struct pwm_keyframe - One point of an animation.
+ * @time_ms: Time of the keyframe from the start of the animation. Keyframe
+ *           times must not decrease.
+ * @red:     Red duty cycle at @time_ms, in the register format.
+ * @green:   Green duty cycle at @time_ms, in the register format.
+ * @blue:    Blue duty cycle at @time_ms, in the register format.
+ * @easing:  PWM_EASE_* curve used to reach this keyframe from the previous.
+ *
+ * While the lut_enable sysfs attribute is set, @red, @green, and @blue are
+ * linear intensities of lut_input_bits bits instead. The animation
+ * interpolates between them, and each value goes through the channel's
+ * lookup table on its way to the register.
+ */
+struct pwm_keyframe {
+	__u32 time_ms;
+	__u32 red;
+	__u32 green;
+	__u32 blue;
+	__u32 easing;
+};
+
+/**
+ * struct pwm_anim - A keyframe animation run by the driver.
+ * @count:   Number of valid entries in @frames, 1 to PWM_ANIM_MAX_KEYFRAMES.
+ * @flags:   PWM_ANIM_* flags.
+ * @tick_us: Update interval in microseconds; 0 selects the 1 ms default.
+ * @reserved: Must be zero.
+ * @frames:  The keyframes.
+ *
+ * A looping animation repeats every frames[count - 1].time_ms, which must
+ * then be non-zero; a one-shot animation holds the last keyframe and stops.
+ */
+struct pwm_anim {
+	__u32 count;
+	__u32 flags;
+	__u32 tick_us;
+	__u32 reserved;
+	struct pwm_keyframe frames[PWM_ANIM_MAX_KEYFRAMES];
+};
+
+/**
+ * struct pwm_lut - Lookup table of one channel.
+ * @channel:  PWM_CHANNEL_* the table applies to.
+ * @reserved: Must be zero.
+ * @table:    Duty cycle register value, u12.11 fixed point, for each 10-bit
+ *            input intensity. 8-bit inputs are scaled to the full table.
+ */
+struct pwm_lut {
+	__u32 channel;
+	__u32 reserved;
+	__u16 table[PWM_LUT_SIZE];
+};
+
+#define PWM_IOC_MAGIC 'p'
+
+/* Apply all registers under one lock hold, so the colour never tears */
+#define PWM_IOC_SET _IOW(PWM_IOC_MAGIC, 0, struct pwm_rgb)
+
+/* Read all registers under one lock hold; duty cycles are after the lookup table */
+#define PWM_IOC_GET _IOR(PWM_IOC_MAGIC, 1, struct pwm_rgb)
+
+/* Start an animation, replacing any running one */
+#define PWM_IOC_ANIM_START _IOW(PWM_IOC_MAGIC, 2, struct pwm_anim)
+
+/* Stop the running animation; the LED keeps its current colour */
+#define PWM_IOC_ANIM_STOP _IO(PWM_IOC_MAGIC, 3)
+
+/* Replace the lookup table of one channel */
+#define PWM_IOC_SET_LUT _IOW(PWM_IOC_MAGIC, 4, struct pwm_lut)
+
+/* Restore the default CIE lightness table on every channel */
+#define PWM_IOC_RESET_LUT _IO(PWM_IOC_MAGIC, 5)
+
+#endif /* _PWM_UAPI_H */
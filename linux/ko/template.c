@@ -14,6 +14,7 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/kstrtox.h>
+#include <linux/bitops.h>
 
 
 
@@ -21,6 +22,8 @@
 #define LED_REG_OFFSET 0x4
 #define BASE_PERIOD_OFFSET 0x8
 
+#define NUM_REGS 4
+
 
 
 
@@ -44,6 +47,9 @@ static const struct of_device_id led_patterns_of_match[] =
  * @led_reg:         Pointer to the led_reg register
  * @miscdev:         miscdevice used to create a character device
  * @lock:            mutex used to prevent concurrent writes to memory
+ * @shadow:          Last value written to each register, guarded by @lock
+ * @shadow_valid:    Bit n is set if @shadow[n] matches the hardware
+ * @dirty:           Bit n is set if @shadow[n] still has to be written
  *
  * An led_patterns_dev struct gets created for each led patterns component.
  */
@@ -55,10 +61,131 @@ struct led_patterns_dev
 	void __iomem *led_reg;
 	struct miscdevice miscdev;
 	struct mutex lock;
+	u32 shadow[NUM_REGS];
+	unsigned long shadow_valid;
+	unsigned long dirty;
 };
 
 
 
+// SHADOW REGISTERS -----------------------------------------------------------
+
+/**
+ * led_patterns_reg_volatile() - Check whether the hardware can change a register.
+ * @priv: The led_patterns device; the caller holds @priv->lock.
+ * @reg:  Register index, the byte offset divided by 4.
+ *
+ * led_reg reflects the hardware pattern generator unless the HPS controls
+ * the LEDs, and the register at 0xC isn't ours to predict.
+ *
+ * Return: true if @reg must always be read from the hardware.
+ */
+static bool led_patterns_reg_volatile(struct led_patterns_dev *priv,
+	unsigned int reg)
+{
+	const unsigned int control = HPS_LED_CONTROL_OFFSET / 4;
+	
+	if (reg == LED_REG_OFFSET / 4)
+	{
+		return !(priv->shadow_valid & BIT(control)) || !priv->shadow[control];
+	}
+	return reg > BASE_PERIOD_OFFSET / 4;
+}
+
+/**
+ * led_patterns_reg_stage() - Stage a register write in the shadow.
+ * @priv: The led_patterns device; the caller holds @priv->lock.
+ * @reg:  Register index, the byte offset divided by 4.
+ * @val:  Value to write.
+ *
+ * The write is dropped if the register is known to hold @val already.
+ * Otherwise it is marked dirty for the next led_patterns_reg_flush().
+ */
+static void led_patterns_reg_stage(struct led_patterns_dev *priv,
+	unsigned int reg, u32 val)
+{
+	if ((priv->shadow_valid & BIT(reg)) && priv->shadow[reg] == val
+		&& !led_patterns_reg_volatile(priv, reg))
+	{
+		return;
+	}
+	
+	priv->shadow[reg] = val;
+	priv->shadow_valid |= BIT(reg);
+	priv->dirty |= BIT(reg);
+}
+
+/**
+ * led_patterns_reg_flush() - Write every dirty register to the hardware.
+ * @priv: The led_patterns device; the caller holds @priv->lock.
+ */
+static void led_patterns_reg_flush(struct led_patterns_dev *priv)
+{
+	unsigned int reg;
+	
+	for_each_set_bit(reg, &priv->dirty, NUM_REGS)
+	{
+		iowrite32(priv->shadow[reg], priv->base_addr + reg * 4);
+	}
+	priv->dirty = 0;
+}
+
+/**
+ * led_patterns_reg_read() - Read a register, from the shadow when possible.
+ * @priv: The led_patterns device; the caller holds @priv->lock.
+ * @reg:  Register index, the byte offset divided by 4.
+ *
+ * Return: The register value.
+ */
+static u32 led_patterns_reg_read(struct led_patterns_dev *priv,
+	unsigned int reg)
+{
+	if ((priv->shadow_valid & BIT(reg)) && !led_patterns_reg_volatile(priv, reg))
+	{
+		return priv->shadow[reg];
+	}
+	
+	return ioread32(priv->base_addr + reg * 4);
+}
+
+/**
+ * led_patterns_reg_get() - Read a register under the device lock.
+ * @priv: The led_patterns device.
+ * @reg:  Register index, the byte offset divided by 4.
+ *
+ * Return: The register value.
+ */
+static u32 led_patterns_reg_get(struct led_patterns_dev *priv,
+	unsigned int reg)
+{
+	u32 val;
+	
+	mutex_lock(&priv->lock);
+	val = led_patterns_reg_read(priv, reg);
+	mutex_unlock(&priv->lock);
+	
+	return val;
+}
+
+/**
+ * led_patterns_reg_set() - Write a register under the device lock, if needed.
+ * @priv: The led_patterns device.
+ * @reg:  Register index, the byte offset divided by 4.
+ * @val:  Value to write.
+ */
+static void led_patterns_reg_set(struct led_patterns_dev *priv,
+	unsigned int reg, u32 val)
+{
+	mutex_lock(&priv->lock);
+	led_patterns_reg_stage(priv, reg, val);
+	led_patterns_reg_flush(priv);
+	mutex_unlock(&priv->lock);
+}
+
+// END OF SHADOW REGISTERS ----------------------------------------------------
+
+
+
 // ATTRIBUTES -----------------------------------------------------------------
 
 /**
@@ -76,7 +203,7 @@ static ssize_t led_reg_show(struct device *dev,
 	u8 led_reg;
 	struct led_patterns_dev *priv = dev_get_drvdata(dev);
 	
-	led_reg = ioread32(priv->led_reg);
+	led_reg = led_patterns_reg_get(priv, LED_REG_OFFSET / 4);
 	
 	return scnprintf(buf, PAGE_SIZE, "%u\n", led_reg);
 }
@@ -106,7 +233,7 @@ static ssize_t led_reg_store(struct device *dev,
 		return ret;
 	}
 	
-	iowrite32(led_reg, priv->led_reg);
+	led_patterns_reg_set(priv, LED_REG_OFFSET / 4, led_reg);
 	
 	// Write was successful, so we return the number of bytes we wrote.
 	return size;
@@ -132,7 +259,7 @@ static ssize_t hps_led_control_show(struct device *dev,
 	// Get the private led_patterns data out of the dev struct
 	struct led_patterns_dev *priv = dev_get_drvdata(dev);
 	
-	hps_control = ioread32(priv->hps_led_control);
+	hps_control = led_patterns_reg_get(priv, HPS_LED_CONTROL_OFFSET / 4);
 	
 	return scnprintf(buf, PAGE_SIZE, "%u\n", hps_control);
 }
@@ -163,7 +290,7 @@ static ssize_t hps_led_control_store(struct device *dev,
 		return ret;
 	}
 	
-	iowrite32(hps_control, priv->hps_led_control);
+	led_patterns_reg_set(priv, HPS_LED_CONTROL_OFFSET / 4, hps_control);
 	
 	// Write was successful, so we return the number of bytes we wrote.
 	return size;
@@ -186,7 +313,7 @@ static ssize_t base_period_show(struct device *dev,
 	u8 base_period;
 	struct led_patterns_dev *priv = dev_get_drvdata(dev);
 	
-	base_period = ioread32(priv->base_period);
+	base_period = led_patterns_reg_get(priv, BASE_PERIOD_OFFSET / 4);
 	
 	return scnprintf(buf, PAGE_SIZE, "%u\n", base_period);
 }
@@ -217,7 +344,7 @@ static ssize_t base_period_store(struct device *dev,
 		return ret;
 	}
 	
-	iowrite32(base_period, priv->base_period);
+	led_patterns_reg_set(priv, BASE_PERIOD_OFFSET / 4, base_period);
 	
 	// Write was successful, so we return the number of bytes we wrote.
 	return size;
@@ -289,7 +416,7 @@ static ssize_t led_patterns_read(struct file *file, char __user *buf,
 		return -EFAULT;
 	}
 	
-	val = ioread32(priv->base_addr + *offset);
+	val = led_patterns_reg_get(priv, *offset / 4);
 	
 	// Copy the value to userspace.
 	size_t ret = copy_to_user(buf, &val, sizeof(val));
@@ -348,7 +475,8 @@ static ssize_t led_patterns_write(struct file *file, const char __user *buf,
 	size_t ret = copy_from_user(&val, buf, sizeof(val));
 	if (ret != sizeof(val))
 	{
-		iowrite32(val, priv->base_addr + *offset);
+		led_patterns_reg_stage(priv, *offset / 4, val);
+		led_patterns_reg_flush(priv);
 		
 		// Increment the file offset by the number of bytes we wrote.
 		*offset = *offset + sizeof(val);
@@ -439,9 +567,12 @@ static int led_patterns_probe(struct platform_device *pdev)
 	priv->base_period = priv->base_addr + BASE_PERIOD_OFFSET;
 	priv->led_reg = priv->base_addr + LED_REG_OFFSET;
 	
+	mutex_init(&priv->lock);
+	
 	// Enable software-control mode and turn all the LEDs on, just for fun.
-	iowrite32(0x00000001, priv->hps_led_control);
-	iowrite32(0x000000FF, priv->led_reg);
+	// This also seeds the shadow registers.
+	led_patterns_reg_set(priv, HPS_LED_CONTROL_OFFSET / 4, 0x00000001);
+	led_patterns_reg_set(priv, LED_REG_OFFSET / 4, 0x000000FF);
 	
 	// Initialize the misc device parameters
 	priv->miscdev.minor = MISC_DYNAMIC_MINOR;
@@ -483,7 +614,7 @@ static int led_patterns_remove(struct platform_device *pdev)
 	struct led_patterns_dev *priv = platform_get_drvdata(pdev);
 	
 	// Disable software-control mode, just for kicks.
-	iowrite32(0, priv->hps_led_control);
+	led_patterns_reg_set(priv, HPS_LED_CONTROL_OFFSET / 4, 0);
 	
 	// Deregister the misc device and remove the /dev/led_patterns file.
 	misc_deregister(&priv->miscdev);
@@ -39,7 +39,9 @@ add_fileset QUARTUS_SYNTH QUARTUS_SYNTH "" ""
 set_fileset_property QUARTUS_SYNTH TOP_LEVEL keyboard
 set_fileset_property QUARTUS_SYNTH ENABLE_RELATIVE_INCLUDE_PATHS false
 set_fileset_property QUARTUS_SYNTH ENABLE_FILE_OVERWRITE_MODE false
-add_fileset_file keyboard.vhd VHDL PATH ../../hdl/bb-calc/keyboard.vhd
+add_fileset_file keyboard.vhd VHDL PATH ../../hdl/final-project/keyboard.vhd TOP_LEVEL_FILE
+add_fileset_file synchronizer.vhd VHDL PATH ../../hdl/common/synchronizer.vhd
+add_fileset_file debouncer.vhd VHDL PATH ../../hdl/common/debouncer.vhd
 
 
 # 
@@ -133,3 +135,20 @@ set_interface_assignment kb_slave embeddedsw.configuration.isMemoryDevice 0
 set_interface_assignment kb_slave embeddedsw.configuration.isNonVolatileStorage 0
 set_interface_assignment kb_slave embeddedsw.configuration.isPrintableDevice 0
 
+
+# 
+# connection point irq
+# 
+add_interface irq interrupt end
+set_interface_property irq associatedAddressablePoint kb_slave
+set_interface_property irq associatedClock clk
+set_interface_property irq associatedReset rst
+set_interface_property irq bridgedReceiverOffset ""
+set_interface_property irq bridgesToReceiver ""
+set_interface_property irq ENABLED true
+set_interface_property irq EXPORT_OF ""
+set_interface_property irq PORT_NAME_MAP ""
+set_interface_property irq CMSIS_SVD_VARIABLES ""
+set_interface_property irq SVD_ADDRESS_GROUP ""
+
+add_interface_port irq irq irq Output 1
@@ -39,7 +39,8 @@ add_fileset QUARTUS_SYNTH QUARTUS_SYNTH "" ""
 set_fileset_property QUARTUS_SYNTH TOP_LEVEL lcd
 set_fileset_property QUARTUS_SYNTH ENABLE_RELATIVE_INCLUDE_PATHS false
 set_fileset_property QUARTUS_SYNTH ENABLE_FILE_OVERWRITE_MODE false
-add_fileset_file lcd.vhd VHDL PATH ../../hdl/bb-calc/lcd.vhd TOP_LEVEL_FILE
+add_fileset_file lcd.vhd VHDL PATH ../../hdl/final-project/lcd.vhd TOP_LEVEL_FILE
+add_fileset_file lcd_fsm.vhd VHDL PATH ../../hdl/final-project/lcd_fsm.vhd
 
 
 # 
@@ -105,10 +105,7 @@ int main (int argc, char **argv)
 		printf("Failed to open /dev/pwm.\n");
 		return 1;
 	}
-	unsigned int pwm_red;
-	unsigned int pwm_green;
-	unsigned int pwm_blue;
-	unsigned int pwm_period;
+	unsigned int pwm_rgb[3];
 	
 	// Open keyboard device file
 	keyboard_file = fopen("/dev/keyboard", "rb+");
@@ -187,20 +184,13 @@ int main (int argc, char **argv)
 		fread(&adc_val, 4, 1, adc_file);
 		fflush(adc_file);
 		
-		pwm_red   = (unsigned int) (1024 * (1 + cos(0.0015332 * adc_val)));
-		pwm_green = (unsigned int) (1024 * (1 + cos(0.0015332 * (adc_val - 1365))));
-		pwm_blue  = (unsigned int) (1024 * (1 + cos(0.0015332 * (adc_val - 2731))));
+		pwm_rgb[0] = (unsigned int) (1024 * (1 + cos(0.0015332 * adc_val)));
+		pwm_rgb[1] = (unsigned int) (1024 * (1 + cos(0.0015332 * (adc_val - 1365))));
+		pwm_rgb[2] = (unsigned int) (1024 * (1 + cos(0.0015332 * (adc_val - 2731))));
 		
+		// Red, green, and blue are consecutive registers; update them in one write
 		fseek(pwm_file, RED_OFFSET, SEEK_SET);
-		fwrite(&pwm_red, 4, 1, pwm_file);
-		fflush(pwm_file);
-		
-		fseek(pwm_file, GREEN_OFFSET, SEEK_SET);
-		fwrite(&pwm_green, 4, 1, pwm_file);
-		fflush(pwm_file);
-	
-		fseek(pwm_file, BLUE_OFFSET, SEEK_SET);
-		fwrite(&pwm_blue, 4, 1, pwm_file);
+		fwrite(pwm_rgb, 4, 3, pwm_file);
 		fflush(pwm_file);
 		
 		usleep(1000);
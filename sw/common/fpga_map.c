@@ -0,0 +1,100 @@
+/**
+ * FPGA Register Window Mapping
+ */
+
+#include "fpga_map.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+
+/**
+ * fpga_map_open() - Map a component's register window.
+ * @map:      Filled in on success.
+ * @dev_path: Device file of the component, e.g. "/dev/adc".
+ * @span:     Size of the register window in bytes.
+ * @rw_fallback: Keep the device file open and access registers with pread()
+ *            and pwrite() if the driver refuses the mapping. Only pass true
+ *            for device files whose offsets address registers (/dev/adc and
+ *            /dev/pwm).
+ *
+ * The drivers only map windows that start on a page boundary, so the first
+ * register is at the start of the mapping. A driver refuses the mapping with
+ * EINVAL when the window doesn't fill a page of its own.
+ *
+ * Return: 0 on success, -1 on failure with errno set.
+ */
+int fpga_map_open(struct fpga_map *map, const char *dev_path, size_t span,
+	bool rw_fallback)
+{
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+	map->span = span;
+	map->page_len = (span + page_size - 1) & ~(page_size - 1);
+
+#ifdef FPGA_MAP_MOCK
+	(void) dev_path;
+	(void) rw_fallback;
+	map->fd = -1;
+	map->page = mmap(NULL, map->page_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+	map->fd = open(dev_path, O_RDWR | O_SYNC);
+	if (map->fd < 0)
+	{
+		return -1;
+	}
+
+	map->page = mmap(NULL, map->page_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED, map->fd, 0);
+	if (map->page == MAP_FAILED && errno == EINVAL && rw_fallback)
+	{
+		map->page = NULL;
+		map->page_len = 0;
+		map->regs = NULL;
+		return 0;
+	}
+#endif
+
+	if (map->page == MAP_FAILED)
+	{
+		int err = errno;
+
+		if (map->fd >= 0)
+		{
+			close(map->fd);
+		}
+		errno = err;
+		return -1;
+	}
+
+	map->regs = (volatile uint32_t *) map->page;
+	return 0;
+}
+
+
+
+/**
+ * fpga_map_close() - Unmap a register window and close its device file.
+ * @map: The mapped window.
+ */
+void fpga_map_close(struct fpga_map *map)
+{
+	if (map->page != NULL)
+	{
+		munmap(map->page, map->page_len);
+	}
+
+	if (map->fd >= 0)
+	{
+		close(map->fd);
+	}
+
+	map->page = NULL;
+	map->regs = NULL;
+	map->fd = -1;
+}
@@ -0,0 +1,101 @@
+/**
+ * FPGA Register Window Mapping
+ *
+ * Maps a component's Avalon register window into the process through the
+ * mmap() method of its driver (/dev/adc, /dev/pwm, /dev/keyboard, /dev/lcd),
+ * so registers can be read and written without a syscall per access.
+ *
+ * The drivers only allow the mapping when the window fills whole pages of its
+ * own, as every component does in the bb_calc device tree. With an older
+ * device tree, where the windows share a page, /dev/adc and /dev/pwm can fall
+ * back to pread()/pwrite() at the register offset. /dev/keyboard and /dev/lcd
+ * can't, since their file offsets don't address registers.
+ *
+ * Build with -DFPGA_MAP_MOCK to replace the device mappings with zeroed
+ * anonymous memory. Programs then run on an x86 host without the board;
+ * registers simply hold whatever was last written to them.
+ */
+
+#ifndef FPGA_MAP_H
+#define FPGA_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+
+
+// Spans of the components' register windows, from the device tree
+#define ADC_SPAN 0x1000
+#define PWM_SPAN 0x1000
+#define KB_SPAN  0x1000
+#define LCD_SPAN 0x1000
+
+
+
+/**
+ * struct fpga_map - A mapped register window.
+ * @fd:       Device file descriptor, or -1 for mock mappings
+ * @page:     Start of the mapping, or NULL when the driver refused it
+ * @page_len: Length of the mapping in bytes
+ * @regs:     First register of the window, or NULL when registers go
+ *            through @fd
+ * @span:     Size of the register window in bytes
+ */
+struct fpga_map
+{
+	int fd;
+	void *page;
+	size_t page_len;
+	volatile uint32_t *regs;
+	size_t span;
+};
+
+
+
+int fpga_map_open(struct fpga_map *map, const char *dev_path, size_t span,
+	bool rw_fallback);
+void fpga_map_close(struct fpga_map *map);
+
+
+
+/**
+ * fpga_map_read() - Read a register from a mapped window.
+ * @map:    The mapped window.
+ * @offset: Byte offset of the register; must be 4-byte aligned.
+ *
+ * Return: The register value, or 0 if the read failed.
+ */
+static inline uint32_t fpga_map_read(const struct fpga_map *map, size_t offset)
+{
+	uint32_t val = 0;
+	
+	if (map->regs != NULL)
+	{
+		return map->regs[offset / sizeof(uint32_t)];
+	}
+	
+	pread(map->fd, &val, sizeof(val), offset);
+	return val;
+}
+
+/**
+ * fpga_map_write() - Write a register in a mapped window.
+ * @map:    The mapped window.
+ * @offset: Byte offset of the register; must be 4-byte aligned.
+ * @val:    Value to write.
+ */
+static inline void fpga_map_write(const struct fpga_map *map, size_t offset,
+	uint32_t val)
+{
+	if (map->regs != NULL)
+	{
+		map->regs[offset / sizeof(uint32_t)] = val;
+		return;
+	}
+	
+	pwrite(map->fd, &val, sizeof(val), offset);
+}
+
+#endif
@@ -10,27 +10,61 @@
 #include <unistd.h>
 #include <signal.h>
 
+#include "../common/fpga_map.h"
 
 
-FILE *adc_file;
+
+// Register windows are mapped with mmap() when the drivers allow it, so the loop
+// never enters the kernel; otherwise registers are read and written through the
+// device files
+struct fpga_map adc_map;
 #define CH0_OFFSET 0x0
+#define ADC_VALUE_BITMASK 0xFFF
 
-FILE *pwm_file;
+struct fpga_map pwm_map;
 #define RED_OFFSET 0x0
 #define GREEN_OFFSET 0x4
 #define BLUE_OFFSET 0x8
 #define PERIOD_OFFSET 0xC
 
-FILE *kb_file;
+// The pwm driver's ADC-to-hue bridge runs the colour loop in the kernel
+#define BRIDGE_RATE_PATH "/sys/devices/platform/ff201000.pwm/bridge_rate"
+#define BRIDGE_RATE_HZ 1000
+bool bridge_running = false;
+
+struct fpga_map kb_map;
 #define BUFFER_OFFSET 0x0
 
-FILE *lcd_file;
+struct fpga_map lcd_map;
 #define CTL_OFFSET 0x0
 #define DATA_OFFSET 0x4
 FILE *lcd_msg_file;
 
 
 
+/**
+ * bridge_set_rate() - Start or stop the pwm driver's ADC-to-hue bridge.
+ * @rate: Update rate in Hz; 0 stops the bridge.
+ * 
+ * Return: true on success, false if the bridge isn't available.
+ */
+bool bridge_set_rate(unsigned int rate)
+{
+	FILE *f = fopen(BRIDGE_RATE_PATH, "w");
+	if (f == NULL)
+	{
+		return false;
+	}
+	
+	bool ok = fprintf(f, "%u\n", rate) > 0;
+	// sysfs reports a rejected value when the write is flushed
+	ok = (fclose(f) == 0) && ok;
+	
+	return ok;
+}
+
+
+
 /**
  * ctlc_handler() - 
  */
@@ -39,10 +73,16 @@ void ctlc_handler(int sig)
 	signal(sig, SIG_IGN);
 	printf("\n\n\n");
 	
-	fclose(adc_file);
-	fclose(pwm_file);
-	fclose(kb_file);
-	fclose(lcd_file);
+	// Leave the LED at its last colour, as the userspace loop did
+	if (bridge_running)
+	{
+		bridge_set_rate(0);
+	}
+	
+	fpga_map_close(&adc_map);
+	fpga_map_close(&pwm_map);
+	fpga_map_close(&kb_map);
+	fpga_map_close(&lcd_map);
 	fclose(lcd_msg_file);
 	
 	exit(0);
@@ -89,18 +129,16 @@ float cos(float angle)
  */
 int main (int argc, char **argv)
 {
-	// Open ADC device file
-	adc_file = fopen("/dev/adc", "rb+");
-	if (adc_file == NULL)
+	// Open ADC registers
+	if (fpga_map_open(&adc_map, "/dev/adc", ADC_SPAN, true) < 0)
 	{
 		printf("Failed to open /dev/adc.\n");
 		return 1;
 	}
 	uint32_t adc_val;
 	
-	// Open PWM RGB LED device file
-	pwm_file = fopen("/dev/pwm", "rb+");
-	if (pwm_file == NULL)
+	// Open PWM RGB LED registers
+	if (fpga_map_open(&pwm_map, "/dev/pwm", PWM_SPAN, true) < 0)
 	{
 		printf("Failed to open /dev/pwm.\n");
 		return 1;
@@ -110,22 +148,20 @@ int main (int argc, char **argv)
 	unsigned int pwm_blue;
 	unsigned int pwm_period;
 	
-	// Open keyboard device file
-	keyboard_file = fopen("/dev/keyboard", "rb+");
-	if (kb_file == NULL)
+	// Map keyboard registers
+	if (fpga_map_open(&kb_map, "/dev/keyboard", KB_SPAN, false) < 0)
 	{
-		printf("Failed to open /dev/keyboard.\n");
+		printf("Failed to map /dev/keyboard.\n");
 		return 1;
 	}
 	unsigned int kb_buffer;
 	
-	// Open lcd device file
-	lcd_file = fopen("/dev/lcd", "rb+");
-	if (lcd_file == NULL)
+	// Map lcd registers
+	if (fpga_map_open(&lcd_map, "/dev/lcd", LCD_SPAN, false) < 0)
 	{
-		printf("Failed to open /dev/lcd.\n");
+		printf("Failed to map /dev/lcd.\n");
 		return 1;
-	}	
+	}
 	uint32_t lcd_ctl;
 	uint32_t lcd_data;
 	
@@ -152,9 +188,7 @@ int main (int argc, char **argv)
 	while(fscanf(lcd_msg_file, "%X", &val) != EOF)
 	{
 		lcd_data = val;
-		fseek(lcd_file, DATA_OFFSET, SEEK_SET);
-		fwrite(&lcd_data, 4, 1, lcd_file);
-		fflush(lcd_file);
+		fpga_map_write(&lcd_map, DATA_OFFSET, lcd_data);
 		usleep(1000);
 		
 		// If no file was given, assume a control file is being read from
@@ -168,40 +202,36 @@ int main (int argc, char **argv)
 			lcd_ctl = 0x00000001; // LCD instruction
 		}
 		
-		fseek(lcd_file, CTL_OFFSET, SEEK_SET);
-		fwrite(&lcd_ctl, 4, 1, lcd_file);
-		fflush(lcd_file);
+		fpga_map_write(&lcd_map, CTL_OFFSET, lcd_ctl);
 		usleep(1000);
 		
 		lcd_ctl = 0x00000000;
-		fseek(lcd_file, CTL_OFFSET, SEEK_SET);
-		fwrite(&lcd_ctl, 4, 1, lcd_file);
-		fflush(lcd_file);
+		fpga_map_write(&lcd_map, CTL_OFFSET, lcd_ctl);
 		usleep(1000);
 	}
 	
+	// Let the kernel map CH0 to the colour when it can; print the value once a second.
+	bridge_running = bridge_set_rate(BRIDGE_RATE_HZ);
+	while (bridge_running)
+	{
+		adc_val = fpga_map_read(&adc_map, CH0_OFFSET) & ADC_VALUE_BITMASK;
+		printf("%u\n", adc_val);
+		sleep(1);
+	}
+	
+	// Without the bridge (older driver, or FPGA_MAP_MOCK), compute the colour here.
 	int print_count = 0;
 	while (true)
 	{
-		fseek(adc_file, CH0_OFFSET, SEEK_SET);
-		fread(&adc_val, 4, 1, adc_file);
-		fflush(adc_file);
+		adc_val = fpga_map_read(&adc_map, CH0_OFFSET) & ADC_VALUE_BITMASK;
 		
 		pwm_red   = (unsigned int) (1024 * (1 + cos(0.0015332 * adc_val)));
 		pwm_green = (unsigned int) (1024 * (1 + cos(0.0015332 * (adc_val - 1365))));
 		pwm_blue  = (unsigned int) (1024 * (1 + cos(0.0015332 * (adc_val - 2731))));
 		
-		fseek(pwm_file, RED_OFFSET, SEEK_SET);
-		fwrite(&pwm_red, 4, 1, pwm_file);
-		fflush(pwm_file);
-		
-		fseek(pwm_file, GREEN_OFFSET, SEEK_SET);
-		fwrite(&pwm_green, 4, 1, pwm_file);
-		fflush(pwm_file);
-	
-		fseek(pwm_file, BLUE_OFFSET, SEEK_SET);
-		fwrite(&pwm_blue, 4, 1, pwm_file);
-		fflush(pwm_file);
+		fpga_map_write(&pwm_map, RED_OFFSET, pwm_red);
+		fpga_map_write(&pwm_map, GREEN_OFFSET, pwm_green);
+		fpga_map_write(&pwm_map, BLUE_OFFSET, pwm_blue);
 		
 		usleep(1000);
 		